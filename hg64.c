@@ -14,44 +14,242 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "hg64.h"
 
+/*
+ * Static tracepoints for bpftrace, perf, etc. when compiled with
+ * -DHG64_USDT; they are a nop until a tracer attaches, and they
+ * vanish otherwise. The probes are:
+ *
+ *	hg64:bin_alloc(hg, bin, bytes)	a new bin was installed
+ *	hg64:bin_race(hg, bin)		lost the race to install a bin
+ *	hg64:record(hg, key, raw)	a counter reached a power of two
+ *	hg64:snapshot_start(hg)
+ *	hg64:snapshot_done(hg, hs, bytes, population)
+ *	hg64:merge_start(target, source)
+ *	hg64:merge_done(target, source)
+ */
+#ifdef HG64_USDT
+#include <sys/sdt.h>
+#define PROBE(...) STAP_PROBEV(hg64, __VA_ARGS__)
+#else
+#define PROBE(...) ((void)0)
+#endif
+
 /* number of bins is same as number of bits in a value */
 #define BINS 64
 
+/* maximum number of SLO thresholds per histogram */
+#define THRESHOLDS 8
+
+/* fractional bits in the counters of weighted histograms */
+#define WEIGHT_BITS 20
+
+/*
+ * number of rank queries remembered by each snapshot
+ */
+#define MEMO 8
+
 typedef atomic_uint_fast64_t counter;
 typedef _Atomic(counter *) bin_ptr;
 
+/*
+ * A bin that is shared between a histogram and its clones is
+ * read-only. A bin pointer to a share is tagged by setting its
+ * least significant bit, so writers can detect it cheaply and
+ * take the slow path to copy the bin.
+ */
+struct share {
+	atomic_uint refs;
+	counter *bp;
+};
+
+#define SHARED 1
+
+static inline bool
+is_shared(counter *bp) {
+	return(((uintptr_t)bp & SHARED) != 0);
+}
+
+static inline struct share *
+to_share(counter *bp) {
+	return((struct share *)((uintptr_t)bp - SHARED));
+}
+
+static inline counter *
+from_share(struct share *sh) {
+	return((counter *)((uintptr_t)sh + SHARED));
+}
+
+/*
+ * bins that have been removed by hg64_compact(), or references to
+ * shared bins that the histogram has stopped using, which might
+ * still be in use by other threads
+ */
+struct retired {
+	struct retired *next;
+	unsigned bin;
+	counter *bp;
+	struct share *share;
+};
+
 struct hg64 {
 	unsigned sigbits;
+	/* counters are fixed point with this many fractional bits */
+	unsigned fixed;
 	bin_ptr bin[BINS];
+	/*
+	 * optional running totals for each bin, followed by the
+	 * population; allocated separately to avoid false sharing
+	 * with the bin pointers, and NULL if they are not wanted
+	 */
+	counter *total;
+	/*
+	 * SLO thresholds: count values whose keys are greater than
+	 * the threshold's key; the number of thresholds is only
+	 * increased after the new threshold has been set up
+	 */
+	atomic_uint thresholds;
+	struct {
+		unsigned key;
+		counter over;
+	} threshold[THRESHOLDS];
+	_Atomic(struct retired *) retired;
+	/* changed by anything other than adding values */
+	counter generation;
 };
 
+/*
+ * the raw bin pointer, which might be shared,
+ * for when we need to write to the bin
+ */
 static inline counter *
-get_bin(hg64 *hg, unsigned b) {
+load_bin(hg64 *hg, unsigned b) {
 	/* key_to_new_counter() below has the matching store / release */
 	return(atomic_load_explicit(&hg->bin[b], memory_order_acquire));
 }
 
 /*
- * static snapshot of a histogram extented with summary data
+ * the bin's counters, for reading
+ */
+static inline counter *
+get_bin(hg64 *hg, unsigned b) {
+	counter *bp = load_bin(hg, b);
+	return(is_shared(bp) ? to_share(bp)->bp : bp);
+}
+
+/*
+ * bumped after a change is complete, so a reader that saw the old
+ * generation will look again
+ */
+static inline void
+changed(hg64 *hg) {
+	atomic_fetch_add_explicit(&hg->generation, 1, memory_order_release);
+}
+
+static void
+retire(hg64 *hg, unsigned b, counter *bp, struct share *share) {
+	struct retired *r = malloc(sizeof(*r));
+	r->bin = b;
+	r->bp = bp;
+	r->share = share;
+	r->next = atomic_load_explicit(&hg->retired, memory_order_relaxed);
+	while(!atomic_compare_exchange_weak_explicit(
+			&hg->retired, &r->next, r,
+			memory_order_release, memory_order_relaxed)) {
+	}
+}
+
+/*
+ * Each histogram that shares a bin holds a reference to it, and the
+ * bin is freed when the last reference goes. A histogram's readers
+ * can still be using a shared bin after it stops sharing it, so
+ * unless `now` is true (the histogram is quiescent) its reference is
+ * retired, and only dropped by `hg64_reclaim()`. So a bin is not
+ * freed until every histogram that shared it has been reclaimed.
  */
+static void
+drop_share(struct share *sh) {
+	if(atomic_fetch_sub_explicit(&sh->refs, 1,
+				     memory_order_acq_rel) == 1) {
+		free(sh->bp);
+		free(sh);
+	}
+}
+
+static void
+release_share(hg64 *hg, unsigned b, struct share *sh, bool now) {
+	if(now) {
+		drop_share(sh);
+	} else {
+		retire(hg, b, NULL, sh);
+	}
+}
+
+/*
+ * A remembered answer to a rank query. Snapshots are shared between
+ * threads, so each slot is protected by a sequence lock: an odd
+ * sequence number means a write is in progress, and zero means the
+ * slot is empty (so a zeroed snapshot has an empty memo).
+ */
+struct memo {
+	atomic_uint seq;
+	atomic_uint_fast64_t rank;
+	atomic_uint_fast64_t value;
+};
+
+/*
+ * Static snapshot of a histogram extented with summary data. A
+ * snapshot is a single allocation with no pointers, so that it can be
+ * saved and mapped back into memory to be queried in place; the
+ * counters for the bins in the binmap are packed together, and each
+ * bin's position in the array is recorded in `offset[]`.
+ */
+#define SNAPSHOT_MAGIC 0x73343667 /* "g64s" little-endian */
+#define SNAPSHOT_VERSION 1
+#define READONLY 1
+
 struct hg64s {
 	unsigned sigbits;
+	uint32_t magic;
+	uint32_t version;
+	uint32_t flags;
 	uint64_t binmap;
 	uint64_t population;
 	uint64_t total[BINS];
-	uint64_t *bin[BINS];
+	/* cumulative totals of the bins before each bin */
+	uint64_t below[BINS];
+	/* sums of bucket midpoints, for the whole snapshot and cumulative */
+	double sum;
+	double sumbelow[BINS];
+	/* recent queries; mutable even though the snapshot is const */
+	struct memo memo[MEMO];
+	/* references held via a publisher */
+	atomic_uint refs;
+	uint32_t offset[BINS];
 	uint64_t counters[];
 };
 
+/*
+ * get a snapshot bin's counters, or NULL if it has none
+ */
+static inline uint64_t *
+bin_counters(const hg64s *hs, unsigned b) {
+	if((hs->binmap & (1ULL << b)) == 0) {
+		return(NULL);
+	}
+	return((uint64_t *)hs->counters + hs->offset[b]);
+}
+
 /*
  * when we only care about the histogram precision
  */
@@ -115,6 +313,11 @@ hg64_create(unsigned sigbits) {
 	}
 	hg64 *hg = malloc(sizeof(*hg));
 	hg->sigbits = sigbits;
+	hg->fixed = 0;
+	hg->total = NULL;
+	atomic_init(&hg->thresholds, 0);
+	atomic_init(&hg->retired, NULL);
+	atomic_init(&hg->generation, 0);
 	/*
 	 * it is probably portable to zero-initialize atomics but the
 	 * C standard says we shouldn't rely on it; but this loop
@@ -126,15 +329,99 @@ hg64_create(unsigned sigbits) {
 	return(hg);
 }
 
+hg64 *
+hg64_create_totals(unsigned sigbits) {
+	hg64 *hg = hg64_create(sigbits);
+	if(hg == NULL) {
+		return(NULL);
+	}
+	/* one extra for the population */
+	hg->total = malloc(sizeof(counter) * (BINS + 1));
+	for (unsigned b = 0; b <= BINS; b++) {
+		atomic_init(&hg->total[b], 0);
+	}
+	return(hg);
+}
+
+hg64 *
+hg64_create_weighted(unsigned sigbits) {
+	hg64 *hg = hg64_create(sigbits);
+	if(hg != NULL) {
+		hg->fixed = WEIGHT_BITS;
+	}
+	return(hg);
+}
+
 void
 hg64_destroy(hg64 *hg) {
 	for(unsigned b = 0; b < BINS; b++) {
-		free(get_bin(hg, b));
+		counter *bp = load_bin(hg, b);
+		if(is_shared(bp)) {
+			release_share(hg, b, to_share(bp), true);
+		} else {
+			free(bp);
+		}
+	}
+	struct retired *r = atomic_load(&hg->retired);
+	while(r != NULL) {
+		struct retired *next = r->next;
+		if(r->share != NULL) {
+			drop_share(r->share);
+		}
+		free(r->bp);
+		free(r);
+		r = next;
 	}
+	free(hg->total);
 	*hg = (hg64){ 0 };
 	free(hg);
 }
 
+void
+hg64_clear(hg64 *hg) {
+	unsigned binsize = BINSIZE(hg);
+	for(unsigned b = 0; b < BINS; b++) {
+		counter *bp = load_bin(hg, b);
+		/*
+		 * A concurrent update can increment its counter before
+		 * its total, so we can't skip bins whose total is zero.
+		 * Instead, subtract what was cleared from the totals, so
+		 * they stay equal to the sums of the counters.
+		 */
+		uint64_t cleared = 0;
+		/* shared bins are read-only, so stop using them */
+		if(is_shared(bp) &&
+		   atomic_compare_exchange_strong_explicit(
+				&hg->bin[b], &bp, NULL,
+				memory_order_acq_rel, memory_order_acquire)) {
+			struct share *sh = to_share(bp);
+			for(unsigned c = 0; c < binsize; c++) {
+				cleared += atomic_load_explicit(&sh->bp[c],
+						memory_order_relaxed);
+			}
+			release_share(hg, b, sh, false);
+		} else {
+			for(unsigned c = 0; bp != NULL && c < binsize; c++) {
+				cleared += atomic_exchange_explicit(&bp[c], 0,
+						memory_order_relaxed);
+			}
+		}
+		if(hg->total != NULL && cleared != 0) {
+			atomic_fetch_sub_explicit(&hg->total[b], cleared,
+						  memory_order_relaxed);
+			atomic_fetch_sub_explicit(&hg->total[BINS], cleared,
+						  memory_order_relaxed);
+		}
+	}
+	unsigned thresholds = atomic_load_explicit(&hg->thresholds,
+						   memory_order_acquire);
+	for(unsigned i = 0; i < thresholds; i++) {
+		atomic_store_explicit(&hg->threshold[i].over, 0,
+				      memory_order_relaxed);
+	}
+	changed(hg);
+}
+
 unsigned
 hg64_sigbits(hg64 *hg) {
 	return(hg->sigbits);
@@ -148,6 +435,9 @@ hg64_size(hg64 *hg) {
 			bin_bytes += sizeof(counter) * BINSIZE(hg);
 		}
 	}
+	if(hg->total != NULL) {
+		bin_bytes += sizeof(counter) * (BINS + 1);
+	}
 	return(sizeof(hg64) + bin_bytes);
 }
 
@@ -198,38 +488,69 @@ key_to_new_counter(hg64 *hg, unsigned key) {
 	unsigned binsize = BINSIZE(hg);
 	unsigned b = key / binsize;
 	unsigned c = key % binsize;
-	counter *old_bp = NULL;
-	counter *new_bp = malloc(sizeof(counter) * binsize);
-	/* see comment in hg64_create() above */
-	for (unsigned i = 0; i < binsize; i++) {
-		atomic_init(new_bp + i, 0);
-	}
 	bin_ptr *bpp = &hg->bin[b];
-	if(atomic_compare_exchange_strong_explicit(bpp, &old_bp, new_bp,
-			memory_order_acq_rel, memory_order_acquire)) {
-		return(new_bp + c);
-	} else {
-		/* lost the race, so use the winner's counters */
+	for(;;) {
+		counter *old_bp = load_bin(hg, b);
+		if(old_bp != NULL && !is_shared(old_bp)) {
+			/* lost the race, so use the winner's counters */
+			return(old_bp + c);
+		}
+		/* a new bin is zero, or a copy of the shared bin */
+		counter *src = old_bp ? to_share(old_bp)->bp : NULL;
+		counter *new_bp = malloc(sizeof(counter) * binsize);
+		/* see comment in hg64_create() above */
+		for (unsigned i = 0; i < binsize; i++) {
+			atomic_init(new_bp + i, src == NULL ? 0 :
+				    atomic_load_explicit(src + i,
+						memory_order_relaxed));
+		}
+		if(atomic_compare_exchange_strong_explicit(bpp, &old_bp, new_bp,
+				memory_order_acq_rel, memory_order_acquire)) {
+			if(src != NULL) {
+				release_share(hg, b, to_share(old_bp), false);
+			}
+			PROBE(bin_alloc, hg, b, sizeof(counter) * binsize);
+			return(new_bp + c);
+		}
+		PROBE(bin_race, hg, b);
 		free(new_bp);
-		return(old_bp + c);
 	}
 }
 
+/*
+ * write fast path; returns NULL if the bin is missing or shared
+ */
 static inline counter *
 key_to_counter(hg64 *hg, unsigned key) {
-	/* fast path */
 	unsigned binsize = BINSIZE(hg);
 	unsigned b = key / binsize;
 	unsigned c = key % binsize;
-	counter *bp = get_bin(hg, b);
-	return(bp == NULL ? NULL : bp + c);
+	counter *bp = load_bin(hg, b);
+	return(bp == NULL || is_shared(bp) ? NULL : bp + c);
 }
 
 static inline uint64_t
 get_key_count(hg64 *hg, unsigned key) {
-	counter *ctr = key_to_counter(hg, key);
-	return(ctr == NULL ? 0 :
-	       atomic_load_explicit(ctr, memory_order_relaxed));
+	unsigned binsize = BINSIZE(hg);
+	counter *bp = get_bin(hg, key / binsize);
+	return(bp == NULL ? 0 :
+	       atomic_load_explicit(bp + key % binsize,
+				    memory_order_relaxed));
+}
+
+/*
+ * kept out of line, so the common case without thresholds is small
+ */
+static void
+add_over(hg64 *hg, unsigned key, uint64_t inc) {
+	unsigned thresholds = atomic_load_explicit(&hg->thresholds,
+						   memory_order_acquire);
+	for(unsigned i = 0; i < thresholds; i++) {
+		if(key > hg->threshold[i].key) {
+			atomic_fetch_add_explicit(&hg->threshold[i].over, inc,
+						  memory_order_relaxed);
+		}
+	}
 }
 
 static inline void
@@ -237,24 +558,358 @@ add_key_count(hg64 *hg, unsigned key, uint64_t inc) {
 	if(inc == 0) return;
 	counter *ctr = key_to_counter(hg, key);
 	ctr = ctr ? ctr : key_to_new_counter(hg, key);
-	atomic_fetch_add_explicit(ctr, inc, memory_order_relaxed);
+	uint64_t old = atomic_fetch_add_explicit(ctr, inc,
+						 memory_order_relaxed);
+	/* sample logarithmically, when the counter's top bit moves */
+	if((old ^ (old + inc)) > old) {
+		PROBE(record, hg, key, old + inc);
+	}
+	if(hg->total != NULL) {
+		counter *total = hg->total;
+		unsigned b = key / BINSIZE(hg);
+		atomic_fetch_add_explicit(&total[b], inc, memory_order_relaxed);
+		atomic_fetch_add_explicit(&total[BINS], inc,
+					  memory_order_relaxed);
+	}
+	/* a relaxed check is enough to skip the usual case */
+	if(atomic_load_explicit(&hg->thresholds, memory_order_relaxed) != 0) {
+		add_over(hg, key, inc);
+	}
+}
+
+/*
+ * without running totals we have to add up the bin's counters
+ */
+static uint64_t
+get_bin_total(hg64 *hg, unsigned b) {
+	if(hg->total != NULL) {
+		return(atomic_load_explicit(&hg->total[b],
+					    memory_order_relaxed));
+	}
+	unsigned binsize = BINSIZE(hg);
+	counter *bp = get_bin(hg, b);
+	uint64_t total = 0;
+	for(unsigned c = 0; bp != NULL && c < binsize; c++) {
+		total += atomic_load_explicit(&bp[c], memory_order_relaxed);
+	}
+	return(total);
+}
+
+
+/*
+ * Counters, totals, etc. are in raw fixed-point units; these convert
+ * to and from whole counts, rounding to nearest on the way out
+ */
+
+static inline uint64_t
+to_raw(hg64 *hg, uint64_t count) {
+	return(count << hg->fixed);
+}
+
+static inline uint64_t
+to_count(hg64 *hg, uint64_t raw) {
+	return((raw + (1ULL << hg->fixed >> 1)) >> hg->fixed);
+}
+
+/*
+ * Convert a sequence of raw counts to a different number of
+ * fractional bits, rounding down and carrying the remainders
+ * forward so that they are not lost.
+ */
+static inline uint64_t
+convert(uint64_t raw, unsigned from, unsigned to, uint64_t *carry) {
+	if(from <= to) {
+		return(raw << (to - from));
+	}
+	uint64_t acc = *carry + raw;
+	*carry = acc & ((1ULL << (from - to)) - 1);
+	return(acc >> (from - to));
+}
+
+/**********************************************************************/
+
+/*
+ * Kernels for the loops that are worth vectorizing, selected at run
+ * time according to the CPU's features, so that one binary runs well
+ * on a mixed fleet. The variants must give identical results.
+ *
+ * The counters in a live histogram are atomics, so the kernels only
+ * work on plain arrays: converting values to keys for batch ingest,
+ * adding snapshots, and summing bins when summarizing a snapshot.
+ */
+
+#define KERNEL_BLOCK 64
+
+struct kernel {
+	const char *name;
+	bool (*supported)(void);
+	void (*keys)(const struct hg64p *hp, const uint64_t *value,
+		     unsigned *key, size_t n);
+	void (*add)(uint64_t *dst, const uint64_t *src, size_t n);
+	uint64_t (*total)(const uint64_t *src, size_t n);
+};
+
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+ALWAYS_INLINE void
+keys_generic(const struct hg64p *hp, const uint64_t *value,
+	     unsigned *key, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		key[i] = value_to_key(hp, value[i]);
+	}
+}
+
+ALWAYS_INLINE void
+add_generic(uint64_t *dst, const uint64_t *src, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		dst[i] += src[i];
+	}
+}
+
+ALWAYS_INLINE uint64_t
+total_generic(const uint64_t *src, size_t n) {
+	uint64_t total = 0;
+	for(size_t i = 0; i < n; i++) {
+		total += src[i];
+	}
+	return(total);
+}
+
+static bool
+scalar_supported(void) {
+	return(true);
+}
+
+static void
+keys_scalar(const struct hg64p *hp, const uint64_t *value,
+	    unsigned *key, size_t n) {
+	keys_generic(hp, value, key, n);
+}
+
+static void
+add_scalar(uint64_t *dst, const uint64_t *src, size_t n) {
+	add_generic(dst, src, n);
+}
+
+static uint64_t
+total_scalar(const uint64_t *src, size_t n) {
+	return(total_generic(src, n));
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+#include <immintrin.h>
+
+#define TARGET(features) static __attribute__((target(features)))
+
+/*
+ * LZCNT is faster than BSR, and BMI2 has flag-free variable shifts
+ */
+
+static bool
+lzcnt_supported(void) {
+	return(__builtin_cpu_supports("lzcnt") &&
+	       __builtin_cpu_supports("bmi2"));
+}
+
+TARGET("lzcnt,bmi2") void
+keys_lzcnt(const struct hg64p *hp, const uint64_t *value,
+	   unsigned *key, size_t n) {
+	keys_generic(hp, value, key, n);
+}
+
+/*
+ * AVX2 has no 64-bit count-leading-zeros, so its keys are scalar
+ */
+
+static bool
+avx2_supported(void) {
+	return(lzcnt_supported() && __builtin_cpu_supports("avx2"));
+}
+
+TARGET("avx2") void
+add_avx2(uint64_t *dst, const uint64_t *src, size_t n) {
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)(dst + i),
+				    _mm256_add_epi64(d, s));
+	}
+	add_generic(dst + i, src + i, n - i);
+}
+
+TARGET("avx2") uint64_t
+total_avx2(const uint64_t *src, size_t n) {
+	__m256i sum = _mm256_setzero_si256();
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		sum = _mm256_add_epi64(sum, s);
+	}
+	uint64_t lane[4];
+	_mm256_storeu_si256((__m256i *)lane, sum);
+	return(lane[0] + lane[1] + lane[2] + lane[3] +
+	       total_generic(src + i, n - i));
+}
+
+/*
+ * AVX-512 CD has a vector count-leading-zeros, so value_to_key()
+ * can be done eight at a time
+ */
+
+static bool
+avx512_supported(void) {
+	return(lzcnt_supported() && __builtin_cpu_supports("avx512f") &&
+	       __builtin_cpu_supports("avx512cd"));
+}
+
+TARGET("avx512f,avx512cd,lzcnt,bmi2") void
+keys_avx512(const struct hg64p *hp, const uint64_t *value,
+	    unsigned *key, size_t n) {
+	unsigned sigbits = hp->sigbits;
+	__m512i binsize = _mm512_set1_epi64(BINSIZE(hp));
+	__m512i top = _mm512_set1_epi64(63 - sigbits);
+	__m128i shift = _mm_cvtsi32_si128((int)sigbits);
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8) {
+		__m512i v = _mm512_loadu_si512(value + i);
+		__m512i clz = _mm512_lzcnt_epi64(_mm512_or_si512(v, binsize));
+		__m512i exponent = _mm512_sub_epi64(top, clz);
+		__m512i mantissa = _mm512_srlv_epi64(v, exponent);
+		__m512i k = _mm512_add_epi64(_mm512_sll_epi64(exponent, shift),
+					     mantissa);
+		_mm256_storeu_si256((__m256i *)(key + i),
+				    _mm512_cvtepi64_epi32(k));
+	}
+	keys_generic(hp, value + i, key + i, n - i);
+}
+
+TARGET("avx512f") void
+add_avx512(uint64_t *dst, const uint64_t *src, size_t n) {
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8) {
+		__m512i d = _mm512_loadu_si512(dst + i);
+		__m512i s = _mm512_loadu_si512(src + i);
+		_mm512_storeu_si512(dst + i, _mm512_add_epi64(d, s));
+	}
+	add_generic(dst + i, src + i, n - i);
+}
+
+TARGET("avx512f") uint64_t
+total_avx512(const uint64_t *src, size_t n) {
+	__m512i sum = _mm512_setzero_si512();
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8) {
+		sum = _mm512_add_epi64(sum, _mm512_loadu_si512(src + i));
+	}
+	return((uint64_t)_mm512_reduce_add_epi64(sum) +
+	       total_generic(src + i, n - i));
+}
+
+#endif
+
+/*
+ * in order of preference
+ */
+static const struct kernel kernels[] = {
+#if defined(__x86_64__) && defined(__GNUC__)
+	{ "avx512", avx512_supported, keys_avx512, add_avx512, total_avx512 },
+	{ "avx2", avx2_supported, keys_lzcnt, add_avx2, total_avx2 },
+	{ "lzcnt", lzcnt_supported, keys_lzcnt, add_scalar, total_scalar },
+#endif
+	{ "scalar", scalar_supported, keys_scalar, add_scalar, total_scalar },
+};
+
+#define KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static _Atomic(const struct kernel *) kernel;
+
+static const struct kernel *
+find_kernel(const char *name) {
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+#endif
+	for(size_t i = 0; i < KERNELS; i++) {
+		if((name == NULL || strcmp(name, kernels[i].name) == 0) &&
+		   kernels[i].supported()) {
+			return(&kernels[i]);
+		}
+	}
+	return(NULL);
+}
+
+/*
+ * Racing threads all make the same choice. The HG64_KERNEL
+ * environment variable can override it, e.g. to rule out a bad
+ * variant in production.
+ */
+static const struct kernel *
+get_kernel(void) {
+	const struct kernel *k =
+		atomic_load_explicit(&kernel, memory_order_acquire);
+	if(k == NULL) {
+		k = find_kernel(getenv("HG64_KERNEL"));
+		k = k != NULL ? k : find_kernel(NULL);
+		atomic_store_explicit(&kernel, k, memory_order_release);
+	}
+	return(k);
+}
+
+const char *
+hg64_kernel(const char *name) {
+	const struct kernel *k = name == NULL ? get_kernel()
+		: find_kernel(name);
+	if(k != NULL) {
+		atomic_store_explicit(&kernel, k, memory_order_release);
+	}
+	return(k == NULL ? NULL : k->name);
 }
 
+void
+hg64_add_array(hg64 *hg, const uint64_t *value, size_t n) {
+	const struct kernel *k = get_kernel();
+	const struct hg64p *hp = &(struct hg64p){ hg->sigbits };
+	uint64_t one = to_raw(hg, 1);
+	unsigned key[KERNEL_BLOCK];
+	for(size_t i = 0; i < n; i += KERNEL_BLOCK) {
+		size_t len = n - i < KERNEL_BLOCK ? n - i : KERNEL_BLOCK;
+		k->keys(hp, value + i, key, len);
+		for(size_t j = 0; j < len; j++) {
+			add_key_count(hg, key[j], one);
+		}
+	}
+}
 
 /**********************************************************************/
 
 void
 hg64_inc(hg64 *hg, uint64_t value) {
-	add_key_count(hg, value_to_key(hg, value), 1);
+	add_key_count(hg, value_to_key(hg, value), to_raw(hg, 1));
 }
 
 void
 hg64_add(hg64 *hg, uint64_t value, uint64_t inc) {
-	add_key_count(hg, value_to_key(hg, value), inc);
+	add_key_count(hg, value_to_key(hg, value), to_raw(hg, inc));
 }
 
 void
-hg64_put(hg64 *hg, uint64_t min, uint64_t max, uint64_t count) {
+hg64_add_weight(hg64 *hg, uint64_t value, double weight) {
+	double raw = weight * (double)(1ULL << hg->fixed) + 0.5;
+	/* the largest whole count, which rounds without overflow */
+	uint64_t max = UINT64_MAX << hg->fixed;
+	/* NaN fails every comparison, so it adds nothing */
+	uint64_t inc = !(raw >= 1.0) ? 0
+		: raw >= (double)max ? max
+		: (uint64_t)raw;
+	add_key_count(hg, value_to_key(hg, value), inc);
+}
+
+/*
+ * spread a raw count across the buckets between min and max
+ */
+static void
+put_raw(hg64 *hg, uint64_t min, uint64_t max, uint64_t count) {
 	unsigned kmin = value_to_key(hg, min);
 	unsigned kmax = value_to_key(hg, max);
 	for(unsigned key = kmin; key <= kmax; key++) {
@@ -269,13 +924,18 @@ hg64_put(hg64 *hg, uint64_t min, uint64_t max, uint64_t count) {
 	}
 }
 
+void
+hg64_put(hg64 *hg, uint64_t min, uint64_t max, uint64_t count) {
+	put_raw(hg, min, max, to_raw(hg, count));
+}
+
 bool
 hg64_get(hg64 *hg, unsigned key,
 		uint64_t *pmin, uint64_t *pmax, uint64_t *pcount) {
 	if(key < KEYS(hg)) {
 		OUTARG(pmin, key_to_minval(hg, key));
 		OUTARG(pmax, key_to_maxval(hg, key));
-		OUTARG(pcount, get_key_count(hg, key));
+		OUTARG(pcount, to_count(hg, get_key_count(hg, key)));
 		return(true);
 	} else {
 		return(false);
@@ -294,35 +954,111 @@ hg64_next(hg64 *hg, unsigned key) {
 	return(key);
 }
 
+/*
+ * This is like hg64_get() and hg64_put() except that it keeps any
+ * fractional counts when the source or target is weighted.
+ */
 void
 hg64_merge(hg64 *target, hg64 *source) {
-	uint64_t min, max, count;
+	uint64_t carry = 0;
+	PROBE(merge_start, target, source);
 	for(unsigned skey = 0;
-	    hg64_get(source, skey, &min, &max, &count);
+	    skey < KEYS(source);
 	    skey = hg64_next(source, skey)) {
-		hg64_put(target, min, max, count);
+		uint64_t raw = get_key_count(source, skey);
+		put_raw(target,
+			key_to_minval(source, skey),
+			key_to_maxval(source, skey),
+			convert(raw, source->fixed, target->fixed, &carry));
 	}
+	PROBE(merge_done, target, source);
+	changed(target);
 }
 
-/**********************************************************************/
-
 /*
- * https://fanf2.user.srcf.net/hermes/doc/antiforgery/stats.pdf
+ * Multiply every counter by the factor, carrying the rounding error
+ * from each counter to the next so the population is scaled
+ * accurately. Each counter is updated with compare-and-swap so that
+ * concurrent increments are not lost, though they may or may not be
+ * scaled. Afterwards the summary counters are recalculated.
  */
 void
-hg64_mean_variance(hg64 *hg, double *pmean, double *pvar) {
-	double pop = 0.0;
-	double mean = 0.0;
-	double sigma = 0.0;
-	uint64_t min, max, count;
-	for(unsigned key = 0;
-	    hg64_get(hg, key, &min, &max, &count);
-	    key = hg64_next(hg, key)) {
-		double delta = (double)min / 2.0 + (double)max / 2.0 - mean;
-		if(count != 0) { /* avoid division by zero */
-			pop += count;
-			mean += count * delta / pop;
-			sigma += count * delta * (min + max - mean);
+hg64_scale(hg64 *hg, double factor) {
+	unsigned binsize = BINSIZE(hg);
+	double carry = 0.0;
+	factor = factor < 0.0 ? 0.0 : factor;
+	for(unsigned b = 0; b < BINS; b++) {
+		counter *bp = load_bin(hg, b);
+		if(is_shared(bp)) {
+			bp = key_to_new_counter(hg, binsize * b);
+		}
+		uint64_t total = 0;
+		for(unsigned c = 0; bp != NULL && c < binsize; c++) {
+			uint64_t old = atomic_load_explicit(&bp[c],
+						memory_order_relaxed);
+			double scaled;
+			uint64_t new;
+			do {
+				scaled = (double)old * factor + carry;
+				new = scaled < 0.5 ? 0 : (uint64_t)(scaled + 0.5);
+			} while(!atomic_compare_exchange_weak_explicit(
+					&bp[c], &old, new,
+					memory_order_relaxed,
+					memory_order_relaxed));
+			carry = scaled - (double)new;
+			total += new;
+		}
+		if(hg->total != NULL) {
+			atomic_store_explicit(&hg->total[b], total,
+					      memory_order_relaxed);
+		}
+	}
+	if(hg->total != NULL) {
+		uint64_t population = 0;
+		for(unsigned b = 0; b < BINS; b++) {
+			population += atomic_load_explicit(&hg->total[b],
+						memory_order_relaxed);
+		}
+		atomic_store_explicit(&hg->total[BINS], population,
+				      memory_order_relaxed);
+	}
+	unsigned thresholds = atomic_load_explicit(&hg->thresholds,
+						   memory_order_acquire);
+	for(unsigned i = 0; i < thresholds; i++) {
+		uint64_t over = 0;
+		for(unsigned key = hg->threshold[i].key + 1;
+		    key < KEYS(hg);
+		    key++) {
+			over += get_key_count(hg, key);
+		}
+		atomic_store_explicit(&hg->threshold[i].over, over,
+				      memory_order_relaxed);
+	}
+	changed(hg);
+}
+
+/**********************************************************************/
+
+/*
+ * https://fanf2.user.srcf.net/hermes/doc/antiforgery/stats.pdf
+ */
+void
+hg64_mean_variance(hg64 *hg, double *pmean, double *pvar) {
+	double pop = 0.0;
+	double mean = 0.0;
+	double sigma = 0.0;
+	double unit = (double)(1ULL << hg->fixed);
+	for(unsigned key = 0;
+	    key < KEYS(hg);
+	    key = hg64_next(hg, key)) {
+		uint64_t min = key_to_minval(hg, key);
+		uint64_t max = key_to_maxval(hg, key);
+		double count = (double)get_key_count(hg, key) / unit;
+		double delta = (double)min / 2.0 + (double)max / 2.0 - mean;
+		if(count != 0) { /* avoid division by zero */
+			pop += count;
+			mean += count * delta / pop;
+			sigma += count * delta * (min + max - mean);
 		}
 	}
 	OUTARG(pmean, mean);
@@ -331,55 +1067,208 @@ hg64_mean_variance(hg64 *hg, double *pmean, double *pvar) {
 
 /**********************************************************************/
 
-hg64s *
-hg64_snapshot(hg64 *hg) {
+/*
+ * Compaction and reclamation use a quiescent-state-based scheme,
+ * which keeps all the synchronization out of the update fast path.
+ * A bin is removed by swapping its pointer for NULL, after which new
+ * updates allocate a new bin; but a thread that loaded the old pointer
+ * just before the swap can still increment a counter in the old bin,
+ * so it is added to a list of retired bins instead of being freed. It
+ * is up to the caller to know when all such threads have finished.
+ */
+
+size_t
+hg64_compact(hg64 *hg) {
 	unsigned binsize = BINSIZE(hg);
-	uint64_t binmap = 0;
-	size_t bytes = 0;
-	/*
-	 * first find out which bins we will copy across
-	 * (as a bitmap) and how much space they need
-	 */
+	size_t retired = 0;
 	for(unsigned b = 0; b < BINS; b++) {
-		if(get_bin(hg, b) != NULL) {
-			binmap |= 1 << b;
-			bytes += binsize * sizeof(uint64_t);
+		counter *bp = load_bin(hg, b);
+		bool empty = bp != NULL && !is_shared(bp);
+		for(unsigned c = 0; empty && c < binsize; c++) {
+			empty = atomic_load_explicit(&bp[c],
+					memory_order_relaxed) == 0;
 		}
+		if(!empty || !atomic_compare_exchange_strong_explicit(
+				&hg->bin[b], &bp, NULL,
+				memory_order_acq_rel, memory_order_acquire)) {
+			continue;
+		}
+		retire(hg, b, bp, NULL);
+		retired++;
 	}
-	hg64s *hs = malloc(sizeof(hg64s) + bytes);
-	memset(hs, 0, sizeof(hg64s) + bytes);
-	hs->sigbits = hg->sigbits;
-	hs->binmap = binmap;
-	/*
-	 * second, copy the data, using the bin bitmap not get_bin()
-	 * because concurrent threads may have added new bins
-	 */
+	if(retired > 0) {
+		changed(hg);
+	}
+	return(retired);
+}
+
+void
+hg64_reclaim(hg64 *hg) {
+	unsigned binsize = BINSIZE(hg);
+	struct retired *r = atomic_exchange_explicit(&hg->retired, NULL,
+						     memory_order_acquire);
+	while(r != NULL) {
+		/*
+		 * Move any late increments into the live bin. They
+		 * were counted in the totals when they were made.
+		 * Shared bins are read-only so they have none.
+		 */
+		for(unsigned c = 0; r->share == NULL && c < binsize; c++) {
+			uint64_t inc = atomic_load_explicit(&r->bp[c],
+						memory_order_relaxed);
+			if(inc != 0) {
+				unsigned key = binsize * r->bin + c;
+				counter *ctr = key_to_counter(hg, key);
+				ctr = ctr ? ctr : key_to_new_counter(hg, key);
+				atomic_fetch_add_explicit(ctr, inc,
+						memory_order_relaxed);
+			}
+		}
+		struct retired *next = r->next;
+		if(r->share != NULL) {
+			drop_share(r->share);
+		}
+		free(r->bp);
+		free(r);
+		r = next;
+	}
+	changed(hg);
+}
+
+/**********************************************************************/
+
+hg64 *
+hg64_clone(hg64 *hg) {
+	hg64 *clone = hg64_create(hg->sigbits);
+	clone->fixed = hg->fixed;
+	if(hg->total != NULL) {
+		clone->total = malloc(sizeof(counter) * (BINS + 1));
+		for (unsigned b = 0; b <= BINS; b++) {
+			atomic_init(&clone->total[b],
+				    atomic_load_explicit(&hg->total[b],
+						memory_order_relaxed));
+		}
+	}
+	unsigned thresholds = atomic_load_explicit(&hg->thresholds,
+						   memory_order_acquire);
+	for(unsigned i = 0; i < thresholds; i++) {
+		clone->threshold[i].key = hg->threshold[i].key;
+		atomic_init(&clone->threshold[i].over,
+			    atomic_load_explicit(&hg->threshold[i].over,
+						 memory_order_relaxed));
+	}
+	atomic_init(&clone->thresholds, thresholds);
+	/* both histograms use the same bins, read-only */
 	for(unsigned b = 0; b < BINS; b++) {
-		if(((1 << b) & binmap) == 0) {
+		counter *bp = load_bin(hg, b);
+		if(bp == NULL) {
 			continue;
 		}
-		hs->bin[b] = &hs->counters[binsize * b];
-		for(unsigned c = 0; c < binsize; c++) {
-			unsigned key = binsize * b + c;
-			uint64_t count = get_key_count(hg, key);
-			hs->bin[b][c] = count;
-			hs->total[b] += count;
-			hs->population += count;
+		if(!is_shared(bp)) {
+			struct share *sh = malloc(sizeof(*sh));
+			atomic_init(&sh->refs, 1);
+			sh->bp = bp;
+			bp = from_share(sh);
+			atomic_store_explicit(&hg->bin[b], bp,
+					      memory_order_release);
 		}
+		atomic_fetch_add_explicit(&to_share(bp)->refs, 1,
+					  memory_order_relaxed);
+		atomic_init(&clone->bin[b], bp);
 	}
-	return(hs);
+	return(clone);
 }
 
 /**********************************************************************/
 
-uint64_t
-hg64s_value_at_rank(const hg64s *hs, uint64_t rank) {
-	unsigned maxbin = MAXBIN(hs);
-	unsigned binsize = BINSIZE(hs);
+/*
+ * A pool is a stack of cleared histograms protected by a mutex.
+ */
+struct hg64pool {
+	pthread_mutex_t lock;
+	hg64 *(*create)(unsigned sigbits);
+	unsigned sigbits;
+	size_t count, limit;
+	hg64 *stack[];
+};
+
+hg64pool *
+hg64pool_create(hg64 *(*create)(unsigned sigbits), unsigned sigbits,
+		size_t limit) {
+	hg64pool *pool = malloc(sizeof(*pool) + sizeof(hg64 *) * limit);
+	pool->create = create;
+	pool->sigbits = sigbits;
+	pool->count = 0;
+	pool->limit = limit;
+	pthread_mutex_init(&pool->lock, NULL);
+	return(pool);
+}
+
+void
+hg64pool_destroy(hg64pool *pool) {
+	for(size_t i = 0; i < pool->count; i++) {
+		hg64_destroy(pool->stack[i]);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+hg64 *
+hg64pool_get(hg64pool *pool) {
+	hg64 *hg = NULL;
+	pthread_mutex_lock(&pool->lock);
+	if(pool->count > 0) {
+		hg = pool->stack[--pool->count];
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return(hg != NULL ? hg : pool->create(pool->sigbits));
+}
+
+void
+hg64pool_put(hg64pool *pool, hg64 *hg) {
+	/* clear outside the lock; forget any thresholds */
+	hg64_clear(hg);
+	atomic_store_explicit(&hg->thresholds, 0, memory_order_relaxed);
+	pthread_mutex_lock(&pool->lock);
+	if(pool->count < pool->limit) {
+		pool->stack[pool->count++] = hg;
+		hg = NULL;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	if(hg != NULL) {
+		hg64_destroy(hg);
+	}
+}
+
+/**********************************************************************/
+
+/*
+ * These are the same as the snapshot rank and quantile functions
+ * below, except they work on the live histogram. With running totals
+ * they can skip whole bins; without, they have to scan every counter.
+ */
+
+static uint64_t
+get_population(hg64 *hg) {
+	if(hg->total != NULL) {
+		return(atomic_load_explicit(&hg->total[BINS],
+					    memory_order_relaxed));
+	}
+	uint64_t population = 0;
+	for(unsigned b = 0; b < MAXBIN(hg); b++) {
+		population += get_bin_total(hg, b);
+	}
+	return(population);
+}
+
+static uint64_t
+value_at_raw_rank(hg64 *hg, uint64_t rank) {
+	unsigned maxbin = MAXBIN(hg);
+	unsigned binsize = BINSIZE(hg);
 	unsigned b, c;
 
 	for(b = 0; b < maxbin; b++) {
-		uint64_t count = hs->total[b];
+		uint64_t count = get_bin_total(hg, b);
 		if(rank < count) {
 			break;
 		}
@@ -389,8 +1278,10 @@ hg64s_value_at_rank(const hg64s *hs, uint64_t rank) {
 		return(UINT64_MAX);
 	}
 
+	/* the total can get ahead of the counters */
+	uint64_t count = 0;
 	for(c = 0; c < binsize; c++) {
-		uint64_t count = hs->bin[b][c];
+		count = get_key_count(hg, binsize * b + c);
 		if(rank < count) {
 			break;
 		}
@@ -401,44 +1292,2421 @@ hg64s_value_at_rank(const hg64s *hs, uint64_t rank) {
 	}
 
 	unsigned key = binsize * b + c;
-	uint64_t min = key_to_minval(hs, key);
-	uint64_t max = key_to_maxval(hs, key);
-	uint64_t count = hs->bin[b][c];
+	uint64_t min = key_to_minval(hg, key);
+	uint64_t max = key_to_maxval(hg, key);
 	return(min + interpolate(max - min, rank, count));
 }
 
-uint64_t
-hg64s_rank_of_value(const hg64s *hs, uint64_t value) {
-	unsigned key = value_to_key(hs, value);
-	unsigned binsize = BINSIZE(hs);
+static uint64_t
+raw_rank_of_value(hg64 *hg, uint64_t value) {
+	unsigned key = value_to_key(hg, value);
+	unsigned binsize = BINSIZE(hg);
 	unsigned kb = key / binsize;
 	unsigned kc = key % binsize;
 	uint64_t rank = 0;
 
 	for(unsigned b = 0; b < kb; b++) {
-		rank += hs->total[b];
+		rank += get_bin_total(hg, b);
 	}
 	for(unsigned c = 0; c < kc; c++) {
-		rank += hs->bin[kb][c];
+		rank += get_key_count(hg, binsize * kb + c);
 	}
 
-	uint64_t count = hs->bin[kb][kc];
-	uint64_t min = key_to_minval(hs, key);
-	uint64_t max = key_to_maxval(hs, key);
+	uint64_t count = get_key_count(hg, key);
+	uint64_t min = key_to_minval(hg, key);
+	uint64_t max = key_to_maxval(hg, key);
 	return(rank + interpolate(count, value - min, max - min));
 }
 
 uint64_t
-hg64s_value_at_quantile(const hg64s *hs, double q) {
-	double pop = hs->population;
+hg64_population(hg64 *hg) {
+	return(to_count(hg, get_population(hg)));
+}
+
+uint64_t
+hg64_raw_population(hg64 *hg) {
+	return(get_population(hg));
+}
+
+uint64_t
+hg64_generation(hg64 *hg) {
+	return(atomic_load_explicit(&hg->generation, memory_order_acquire));
+}
+
+uint64_t
+hg64_value_at_rank(hg64 *hg, uint64_t rank) {
+	return(value_at_raw_rank(hg, to_raw(hg, rank)));
+}
+
+uint64_t
+hg64_rank_of_value(hg64 *hg, uint64_t value) {
+	return(to_count(hg, raw_rank_of_value(hg, value)));
+}
+
+uint64_t
+hg64_value_at_quantile(hg64 *hg, double q) {
+	double pop = get_population(hg);
 	double rank = q < 0.0 ? 0.0 : q > 1.0 ? 1.0 : q;
-	return(hg64s_value_at_rank(hs, (uint64_t)(rank * pop)));
+	return(value_at_raw_rank(hg, (uint64_t)(rank * pop)));
 }
 
 double
-hg64s_quantile_of_value(const hg64s *hs, uint64_t value) {
-	uint64_t rank = hg64s_rank_of_value(hs, value);
-	return((double)rank / (double)hs->population);
+hg64_quantile_of_value(hg64 *hg, uint64_t value) {
+	uint64_t rank = raw_rank_of_value(hg, value);
+	return((double)rank / (double)get_population(hg));
+}
+
+/**********************************************************************/
+
+int
+hg64_threshold(hg64 *hg, uint64_t value) {
+	unsigned i = atomic_load_explicit(&hg->thresholds,
+					  memory_order_relaxed);
+	if(i == THRESHOLDS) {
+		return(-1);
+	}
+	unsigned tkey = value_to_key(hg, value);
+	uint64_t over = 0;
+	for(unsigned key = tkey + 1; key < KEYS(hg); key++) {
+		over += get_key_count(hg, key);
+	}
+	hg->threshold[i].key = tkey;
+	atomic_init(&hg->threshold[i].over, over);
+	atomic_store_explicit(&hg->thresholds, i + 1, memory_order_release);
+	return((int)i);
+}
+
+uint64_t
+hg64_threshold_value(hg64 *hg, unsigned i) {
+	return(key_to_maxval(hg, hg->threshold[i].key));
+}
+
+uint64_t
+hg64_threshold_count(hg64 *hg, unsigned i) {
+	return(to_count(hg, atomic_load_explicit(&hg->threshold[i].over,
+						 memory_order_relaxed)));
+}
+
+double
+hg64_threshold_ratio(hg64 *hg, unsigned i) {
+	uint64_t pop = get_population(hg);
+	uint64_t over = atomic_load_explicit(&hg->threshold[i].over,
+					     memory_order_relaxed);
+	return(pop == 0 ? 0.0 : (double)over / (double)pop);
+}
+
+/**********************************************************************/
+
+/*
+ * A tracker keeps each watched quantile's position in the histogram
+ * as the key that contains the quantile's rank, and the number of
+ * values in keys below it. When a value is added, only the positions
+ * above it change, and then each position moves a short distance to
+ * follow its rank.
+ */
+
+struct watch {
+	double quantile;
+	uint64_t threshold;
+	hg64t_cb *cb;
+	void *arg;
+	unsigned key;
+	uint64_t below;
+	uint64_t value;
+	bool above;
+};
+
+struct hg64t {
+	hg64 *hg;
+	uint64_t population;
+	unsigned watches;
+	struct watch *watch;
+};
+
+hg64t *
+hg64t_create(hg64 *hg) {
+	hg64t *t = malloc(sizeof(*t));
+	*t = (hg64t){
+		.hg = hg,
+		.population = get_population(hg),
+	};
+	return(t);
+}
+
+void
+hg64t_destroy(hg64t *t) {
+	free(t->watch);
+	*t = (hg64t){ 0 };
+	free(t);
+}
+
+static void
+track(hg64t *t, struct watch *w) {
+	hg64 *hg = t->hg;
+	unsigned binsize = BINSIZE(hg);
+	uint64_t pop = t->population;
+	if(pop == 0) {
+		return;
+	}
+	uint64_t rank = (uint64_t)(w->quantile * (double)pop);
+	rank = rank < pop ? rank : pop - 1;
+	/* move down while the rank is before the key */
+	while(w->below > rank) {
+		if(w->key % binsize == 0 &&
+		   get_bin(hg, w->key / binsize - 1) == NULL) {
+			w->key -= binsize;
+		} else {
+			w->key -= 1;
+			w->below -= get_key_count(hg, w->key);
+		}
+	}
+	/* move up while the rank is after the key */
+	uint64_t count;
+	for(;;) {
+		if(w->key % binsize == 0 &&
+		   get_bin(hg, w->key / binsize) == NULL) {
+			w->key += binsize;
+			continue;
+		}
+		count = get_key_count(hg, w->key);
+		if(rank < w->below + count) {
+			break;
+		}
+		w->below += count;
+		w->key += 1;
+	}
+	uint64_t min = key_to_minval(hg, w->key);
+	uint64_t max = key_to_maxval(hg, w->key);
+	w->value = min + interpolate(max - min, rank - w->below, count);
+	bool above = w->value > w->threshold;
+	if(above != w->above) {
+		w->above = above;
+		if(w->cb != NULL) {
+			w->cb(w->arg, (unsigned)(w - t->watch), w->value, above);
+		}
+	}
+}
+
+unsigned
+hg64t_watch(hg64t *t, double quantile, uint64_t threshold,
+	    hg64t_cb *cb, void *arg) {
+	unsigned i = t->watches++;
+	t->watch = realloc(t->watch, sizeof(struct watch) * t->watches);
+	t->watch[i] = (struct watch){
+		.quantile = quantile < 0.0 ? 0.0 : quantile,
+		.threshold = threshold,
+		.cb = cb,
+		.arg = arg,
+	};
+	track(t, &t->watch[i]);
+	return(i);
+}
+
+void
+hg64t_add(hg64t *t, uint64_t value, uint64_t inc) {
+	unsigned key = value_to_key(t->hg, value);
+	inc = to_raw(t->hg, inc);
+	add_key_count(t->hg, key, inc);
+	t->population += inc;
+	for(unsigned i = 0; i < t->watches; i++) {
+		struct watch *w = &t->watch[i];
+		if(key < w->key) {
+			w->below += inc;
+		}
+		track(t, w);
+	}
+}
+
+uint64_t
+hg64t_value(hg64t *t, unsigned watch) {
+	return(t->watch[watch].value);
+}
+
+bool
+hg64t_above(hg64t *t, unsigned watch) {
+	return(t->watch[watch].above);
+}
+
+/**********************************************************************/
+
+static inline double
+midpoint(hg64u hu, unsigned key) {
+	return((double)key_to_minval(hu, key) / 2.0 +
+	       (double)key_to_maxval(hu, key) / 2.0);
+}
+
+/*
+ * add up the counters in each bin
+ */
+static void
+count_totals(hg64s *hs) {
+	uint64_t (*total)(const uint64_t *, size_t) = get_kernel()->total;
+	unsigned binsize = BINSIZE(hs);
+	for(unsigned b = 0; b < BINS; b++) {
+		const uint64_t *bp = bin_counters(hs, b);
+		hs->total[b] = bp == NULL ? 0 : total(bp, binsize);
+	}
+}
+
+/*
+ * Fill in a snapshot's summary data from its counters and bin totals.
+ * Within bin b > 0 the midpoint of counter c is linear in c, being
+ * (binsize + c) * 2^(b-1) + (2^(b-1) - 1) / 2, so we only need one
+ * multiply-add per counter, and empty bins are skipped.
+ */
+static void
+summarize(hg64s *hs) {
+	unsigned binsize = BINSIZE(hs);
+	uint64_t below = 0;
+	double sum = 0.0;
+	for(unsigned b = 0; b < BINS; b++) {
+		uint64_t total = hs->total[b];
+		double binsum = 0.0;
+		if(total != 0) {
+			const uint64_t *bp = bin_counters(hs, b);
+			unsigned offset = b == 0 ? 0 : binsize;
+			double weighted = 0.0;
+			for(unsigned c = 0; c < binsize; c++) {
+				weighted += (double)(offset + c) * (double)bp[c];
+			}
+			double scale = b == 0 ? 1.0 : (double)(1ULL << (b - 1));
+			double half = b == 0 ? 0.0 : (scale - 1.0) / 2.0;
+			binsum = weighted * scale + half * (double)total;
+		}
+		hs->below[b] = below;
+		hs->sumbelow[b] = sum;
+		below += total;
+		sum += binsum;
+	}
+	hs->population = below;
+	hs->sum = sum;
+}
+
+/*
+ * allocate a snapshot with space for the bins in the bitmap, which
+ * are packed together in the counters array; the counters are not
+ * initialized unless `zero` is true
+ */
+static hg64s *
+snapshot_alloc(unsigned sigbits, uint64_t binmap, bool zero) {
+	unsigned binsize = BINSIZE(&(struct hg64p){ sigbits });
+	size_t bytes = binsize * sizeof(uint64_t) *
+		       (size_t)__builtin_popcountll(binmap);
+	hg64s *hs = malloc(sizeof(hg64s) + bytes);
+	memset(hs, 0, sizeof(hg64s) + (zero ? bytes : 0));
+	hs->sigbits = sigbits;
+	hs->magic = SNAPSHOT_MAGIC;
+	hs->version = SNAPSHOT_VERSION;
+	hs->binmap = binmap;
+	uint32_t offset = 0;
+	for(unsigned b = 0; b < BINS; b++) {
+		if(((1ULL << b) & binmap) != 0) {
+			hs->offset[b] = offset;
+			offset += binsize;
+		}
+	}
+	return(hs);
+}
+
+static size_t
+snapshot_size(const hg64s *hs) {
+	return(sizeof(hg64s) + sizeof(uint64_t) * BINSIZE(hs) *
+	       (size_t)__builtin_popcountll(hs->binmap));
+}
+
+/*
+ * Copy a bin of counters into a snapshot, returning the bin's total.
+ * The loop is unrolled with several accumulators so the loads and
+ * adds can overlap. (Relaxed atomic loads compile to plain loads.)
+ */
+static uint64_t
+copy_bin(uint64_t *dst, counter *src, unsigned binsize) {
+	uint64_t t0 = 0, t1 = 0, t2 = 0, t3 = 0;
+	unsigned c = 0;
+	for(; c + 4 <= binsize; c += 4) {
+		dst[c + 0] = atomic_load_explicit(src + c + 0,
+						  memory_order_relaxed);
+		dst[c + 1] = atomic_load_explicit(src + c + 1,
+						  memory_order_relaxed);
+		dst[c + 2] = atomic_load_explicit(src + c + 2,
+						  memory_order_relaxed);
+		dst[c + 3] = atomic_load_explicit(src + c + 3,
+						  memory_order_relaxed);
+		t0 += dst[c + 0];
+		t1 += dst[c + 1];
+		t2 += dst[c + 2];
+		t3 += dst[c + 3];
+	}
+	for(; c < binsize; c++) {
+		dst[c] = atomic_load_explicit(src + c, memory_order_relaxed);
+		t0 += dst[c];
+	}
+	return(t0 + t1 + t2 + t3);
+}
+
+/*
+ * weighted counters are converted to whole numbers as they are copied
+ */
+static uint64_t
+copy_weighted_bin(uint64_t *dst, counter *src, unsigned binsize,
+		  unsigned fixed, uint64_t *carry) {
+	uint64_t total = 0;
+	for(unsigned c = 0; c < binsize; c++) {
+		uint64_t raw = atomic_load_explicit(src + c,
+						    memory_order_relaxed);
+		dst[c] = convert(raw, fixed, 0, carry);
+		total += dst[c];
+	}
+	return(total);
+}
+
+hg64s *
+hg64_snapshot(hg64 *hg) {
+	unsigned binsize = BINSIZE(hg);
+	uint64_t binmap = 0;
+	PROBE(snapshot_start, hg);
+	/*
+	 * first find out which bins we will copy across
+	 */
+	for(unsigned b = 0; b < BINS; b++) {
+		if(get_bin(hg, b) != NULL) {
+			binmap |= 1ULL << b;
+		}
+	}
+	hg64s *hs = snapshot_alloc(hg->sigbits, binmap, false);
+	/*
+	 * second, copy the data, using the bin bitmap not get_bin()
+	 * because concurrent threads may have added new bins, and
+	 * bins may have been removed by hg64_compact()
+	 */
+	uint64_t carry = 0;
+	for(unsigned b = 0; b < BINS; b++) {
+		uint64_t *dst = bin_counters(hs, b);
+		if(dst == NULL) {
+			continue;
+		}
+		counter *src = get_bin(hg, b);
+		/* running totals tell us about untouched bins */
+		bool empty = src == NULL ||
+			(hg->total != NULL &&
+			 atomic_load_explicit(&hg->total[b],
+					      memory_order_relaxed) == 0);
+		if(empty) {
+			memset(dst, 0, sizeof(uint64_t) * binsize);
+			hs->total[b] = 0;
+		} else if(hg->fixed == 0) {
+			hs->total[b] = copy_bin(dst, src, binsize);
+		} else {
+			hs->total[b] = copy_weighted_bin(dst, src, binsize,
+							 hg->fixed, &carry);
+		}
+	}
+	summarize(hs);
+	PROBE(snapshot_done, hg, hs, snapshot_size(hs), hs->population);
+	return(hs);
+}
+
+/**********************************************************************/
+
+size_t
+hg64s_save(const hg64s *hs, void *buf, size_t size) {
+	size_t need = snapshot_size(hs);
+	if(size >= need) {
+		hg64s *copy = buf;
+		memcpy(copy, hs, need);
+		memset(copy->memo, 0, sizeof(copy->memo));
+		atomic_init(&copy->refs, 0);
+		copy->flags = READONLY;
+	}
+	return(need);
+}
+
+/*
+ * Check that the snapshot is one of ours, that its bins fit in the
+ * buffer, and that its bin totals add up, but trust the counters
+ * instead of recounting them. It must be marked read-only so that
+ * queries do not write to the buffer.
+ */
+const hg64s *
+hg64s_map(const void *buf, size_t size) {
+	const hg64s *hs = buf;
+	if((uintptr_t)buf % _Alignof(hg64s) != 0 || size < sizeof(hg64s) ||
+	   hs->magic != SNAPSHOT_MAGIC || hs->version != SNAPSHOT_VERSION ||
+	   hs->flags != READONLY || hs->sigbits < 1 || hs->sigbits > 15 ||
+	   (MAXBIN(hs) < 64 && hs->binmap >> MAXBIN(hs) != 0) ||
+	   snapshot_size(hs) != size) {
+		return(NULL);
+	}
+	/*
+	 * queries trust the summary, so check that it is consistent
+	 * with the bin map, but do not scan the counters
+	 */
+	uint32_t offset = 0;
+	uint64_t below = 0;
+	for(unsigned b = 0; b < BINS; b++) {
+		bool present = hs->binmap & (1ULL << b);
+		if((present && hs->offset[b] != offset) ||
+		   (!present && hs->total[b] != 0) ||
+		   hs->below[b] != below ||
+		   __builtin_add_overflow(below, hs->total[b], &below)) {
+			return(NULL);
+		}
+		offset += present ? BINSIZE(hs) : 0;
+	}
+	if(hs->population != below) {
+		return(NULL);
+	}
+	return(hs);
+}
+
+/**********************************************************************/
+
+/*
+ * A publisher's current snapshot has a split reference count. The
+ * pointer and an outer count of readers share one atomic word, so a
+ * reader takes a reference with a single fetch-and-add, and there is
+ * no window between loading the pointer and counting the reference.
+ * Readers release their references by decrementing the inner count
+ * in the snapshot's `refs`.
+ *
+ * While the snapshot is current its inner count is biased upwards,
+ * so releases cannot take it to zero. When the snapshot is replaced,
+ * the outer count is moved to the inner count and the bias removed;
+ * whoever takes it to zero frees it, so the publisher never waits
+ * for readers. The outer count is small, so readers drain it into
+ * the inner count when it gets large.
+ *
+ * The outer count lives in the low bits of the pointer, which are
+ * free because published snapshots are aligned, so this does not
+ * depend on how many bits of an address are significant (5-level
+ * page tables, tagged pointers, etc.) The allocator returns the
+ * slack around an aligned block to its free lists.
+ */
+#define OUTER_ALIGN (1U << 16)
+#define OUTER_ONE 1U
+#define OUTER_DRAIN 4096
+#define INNER_BIAS (1U << 30)
+
+static inline hg64s *
+outer_ptr(uintptr_t word) {
+	return((hg64s *)(word & ~(uintptr_t)(OUTER_ALIGN - 1)));
+}
+
+static inline unsigned
+outer_count(uintptr_t word) {
+	return((unsigned)(word & (OUTER_ALIGN - 1)));
+}
+
+struct hg64pub {
+	hg64 *hg;
+	unsigned ms;
+	bool stop;
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	atomic_uintptr_t current;
+};
+
+/*
+ * adjust the inner count, and free the snapshot if it reaches zero
+ */
+static void
+adjust_refs(const hg64s *hs, unsigned delta) {
+	hg64s *mut = (hg64s *)hs;
+	if(atomic_fetch_add_explicit(&mut->refs, delta,
+				     memory_order_acq_rel) + delta == 0) {
+		free(mut);
+	}
+}
+
+/*
+ * Move the outer count to the inner count, as long as the snapshot
+ * is still current. The inner count is increased first, so that it
+ * is never too low; if the snapshot was replaced meanwhile, the
+ * publisher has moved the outer count as well, so take it back.
+ */
+static void
+drain_outer(hg64pub *pub, uintptr_t word) {
+	hg64s *hs = outer_ptr(word);
+	unsigned count = outer_count(word);
+	adjust_refs(hs, count);
+	if(!atomic_compare_exchange_strong_explicit(&pub->current, &word,
+			(uintptr_t)hs, memory_order_acq_rel,
+			memory_order_relaxed)) {
+		adjust_refs(hs, -count);
+	}
+}
+
+/*
+ * Called with the lock held. If there is no memory for an aligned
+ * copy, the previous snapshot remains current.
+ */
+static bool
+publish(hg64pub *pub) {
+	hg64s *hs = hg64_snapshot(pub->hg);
+	void *aligned = NULL;
+	if(posix_memalign(&aligned, OUTER_ALIGN, snapshot_size(hs)) != 0) {
+		free(hs);
+		return(false);
+	}
+	memcpy(aligned, hs, snapshot_size(hs));
+	free(hs);
+	hs = aligned;
+	atomic_store_explicit(&hs->refs, INNER_BIAS, memory_order_relaxed);
+	uintptr_t old = atomic_exchange_explicit(&pub->current, (uintptr_t)hs,
+						 memory_order_acq_rel);
+	if(outer_ptr(old) != NULL) {
+		adjust_refs(outer_ptr(old), outer_count(old) - INNER_BIAS);
+	}
+	return(true);
+}
+
+static void *
+publisher(void *arg) {
+	hg64pub *pub = arg;
+	pthread_mutex_lock(&pub->lock);
+	while(!pub->stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += pub->ms / 1000;
+		deadline.tv_nsec += (long)(pub->ms % 1000) * 1000 * 1000;
+		if(deadline.tv_nsec >= 1000 * 1000 * 1000) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000 * 1000 * 1000;
+		}
+		int r = 0;
+		while(!pub->stop && r != ETIMEDOUT) {
+			r = pthread_cond_timedwait(&pub->cond, &pub->lock,
+						   &deadline);
+		}
+		if(!pub->stop) {
+			publish(pub);
+		}
+	}
+	pthread_mutex_unlock(&pub->lock);
+	return(NULL);
+}
+
+hg64pub *
+hg64pub_create(hg64 *hg, unsigned ms) {
+	if(ms == 0) {
+		return(NULL);
+	}
+	hg64pub *pub = malloc(sizeof(*pub));
+	*pub = (hg64pub){ .hg = hg, .ms = ms };
+	atomic_init(&pub->current, 0);
+	pthread_mutex_init(&pub->lock, NULL);
+	/* the interval is not affected by changes to the wall clock */
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pub->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if(!publish(pub) ||
+	   pthread_create(&pub->tid, NULL, publisher, pub) != 0) {
+		free(outer_ptr(atomic_load(&pub->current)));
+		pthread_cond_destroy(&pub->cond);
+		pthread_mutex_destroy(&pub->lock);
+		free(pub);
+		return(NULL);
+	}
+	return(pub);
+}
+
+void
+hg64pub_destroy(hg64pub *pub) {
+	pthread_mutex_lock(&pub->lock);
+	pub->stop = true;
+	pthread_cond_signal(&pub->cond);
+	pthread_mutex_unlock(&pub->lock);
+	pthread_join(pub->tid, NULL);
+	uintptr_t word = atomic_load(&pub->current);
+	adjust_refs(outer_ptr(word), outer_count(word) - INNER_BIAS);
+	pthread_cond_destroy(&pub->cond);
+	pthread_mutex_destroy(&pub->lock);
+	free(pub);
+}
+
+void
+hg64pub_refresh(hg64pub *pub) {
+	pthread_mutex_lock(&pub->lock);
+	publish(pub);
+	pthread_mutex_unlock(&pub->lock);
+}
+
+const hg64s *
+hg64pub_get(hg64pub *pub) {
+	uintptr_t word = atomic_fetch_add_explicit(&pub->current, OUTER_ONE,
+						   memory_order_acquire);
+	if(outer_count(word) + 1 >= OUTER_DRAIN) {
+		drain_outer(pub, word + OUTER_ONE);
+	}
+	return(outer_ptr(word));
+}
+
+void
+hg64pub_put(const hg64s *hs) {
+	adjust_refs(hs, -1);
+}
+
+/**********************************************************************/
+
+/*
+ * Fibonacci hashing spreads nearby ranks across the memo slots
+ */
+static struct memo *
+memo_slot(const hg64s *hs, uint64_t rank) {
+	unsigned slot = (rank * 0x9E3779B97F4A7C15ULL) >> 61;
+	return((struct memo *)&hs->memo[slot % MEMO]);
+}
+
+/*
+ * a mapped snapshot may be read-only, so it does not use the memo
+ */
+static bool
+memo_get(const hg64s *hs, uint64_t rank, uint64_t *pvalue) {
+	if(hs->flags & READONLY) {
+		return(false);
+	}
+	struct memo *m = memo_slot(hs, rank);
+	unsigned seq = atomic_load_explicit(&m->seq, memory_order_acquire);
+	if(seq == 0 || seq % 2 == 1) {
+		return(false);
+	}
+	uint64_t r = atomic_load_explicit(&m->rank, memory_order_relaxed);
+	uint64_t v = atomic_load_explicit(&m->value, memory_order_relaxed);
+	atomic_thread_fence(memory_order_acquire);
+	if(atomic_load_explicit(&m->seq, memory_order_relaxed) != seq ||
+	   r != rank) {
+		return(false);
+	}
+	*pvalue = v;
+	return(true);
+}
+
+/*
+ * if another thread is writing the slot, don't wait for it
+ */
+static void
+memo_put(const hg64s *hs, uint64_t rank, uint64_t value) {
+	if(hs->flags & READONLY) {
+		return;
+	}
+	struct memo *m = memo_slot(hs, rank);
+	unsigned seq = atomic_load_explicit(&m->seq, memory_order_relaxed);
+	if(seq % 2 == 1 ||
+	   !atomic_compare_exchange_strong_explicit(&m->seq, &seq, seq + 1,
+						    memory_order_relaxed,
+						    memory_order_relaxed)) {
+		return;
+	}
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&m->rank, rank, memory_order_relaxed);
+	atomic_store_explicit(&m->value, value, memory_order_relaxed);
+	/* skip zero when the sequence number wraps */
+	seq += 2;
+	atomic_store_explicit(&m->seq, seq == 0 ? 2 : seq,
+			      memory_order_release);
+}
+
+static uint64_t
+value_at_rank(const hg64s *hs, uint64_t rank) {
+	unsigned maxbin = MAXBIN(hs);
+	unsigned binsize = BINSIZE(hs);
+	unsigned b, c;
+
+	for(b = 0; b < maxbin; b++) {
+		uint64_t count = hs->total[b];
+		if(rank < count) {
+			break;
+		}
+		rank -= count;
+	}
+	if(b == maxbin) {
+		return(UINT64_MAX);
+	}
+
+	const uint64_t *bp = bin_counters(hs, b);
+	for(c = 0; c < binsize; c++) {
+		uint64_t count = bp[c];
+		if(rank < count) {
+			break;
+		}
+		rank -= count;
+	}
+	if(c == binsize) {
+		return(UINT64_MAX);
+	}
+
+	unsigned key = binsize * b + c;
+	uint64_t min = key_to_minval(hs, key);
+	uint64_t max = key_to_maxval(hs, key);
+	uint64_t count = bp[c];
+	return(min + interpolate(max - min, rank, count));
+}
+
+uint64_t
+hg64s_value_at_rank(const hg64s *hs, uint64_t rank) {
+	uint64_t value;
+	if(memo_get(hs, rank, &value)) {
+		return(value);
+	}
+	value = value_at_rank(hs, rank);
+	memo_put(hs, rank, value);
+	return(value);
+}
+
+uint64_t
+hg64s_rank_of_value(const hg64s *hs, uint64_t value) {
+	unsigned key = value_to_key(hs, value);
+	unsigned binsize = BINSIZE(hs);
+	unsigned kb = key / binsize;
+	unsigned kc = key % binsize;
+	uint64_t rank = hs->below[kb];
+
+	const uint64_t *bp = bin_counters(hs, kb);
+	if(bp == NULL) {
+		return(rank);
+	}
+	for(unsigned c = 0; c < kc; c++) {
+		rank += bp[c];
+	}
+
+	uint64_t count = bp[kc];
+	uint64_t min = key_to_minval(hs, key);
+	uint64_t max = key_to_maxval(hs, key);
+	return(rank + interpolate(count, value - min, max - min));
+}
+
+uint64_t
+hg64s_value_at_quantile(const hg64s *hs, double q) {
+	double pop = hs->population;
+	double rank = q < 0.0 ? 0.0 : q > 1.0 ? 1.0 : q;
+	return(hg64s_value_at_rank(hs, (uint64_t)(rank * pop)));
+}
+
+double
+hg64s_quantile_of_value(const hg64s *hs, uint64_t value) {
+	uint64_t rank = hg64s_rank_of_value(hs, value);
+	return((double)rank / (double)hs->population);
+}
+
+/**********************************************************************/
+
+/*
+ * find the bin containing a rank, i.e. the last bin whose cumulative
+ * total is not greater than the rank
+ */
+static unsigned
+rank_to_bin(const hg64s *hs, uint64_t rank) {
+	unsigned lo = 0, hi = BINS;
+	while(hi - lo > 1) {
+		unsigned mid = (lo + hi) / 2;
+		if(hs->below[mid] <= rank) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return(lo);
+}
+
+/*
+ * Sum of the bucket midpoints of the values before a rank. The
+ * cumulative bin totals and sums find the bin in O(log BINS), then
+ * the bin is scanned, so this is O(log BINS + binsize); per-counter
+ * cumulative indexes would make snapshots three times bigger.
+ */
+static double
+sum_below_rank(const hg64s *hs, uint64_t rank) {
+	if(rank >= hs->population) {
+		return(hs->sum);
+	}
+	unsigned binsize = BINSIZE(hs);
+	unsigned b = rank_to_bin(hs, rank);
+	double sum = hs->sumbelow[b];
+	rank -= hs->below[b];
+	const uint64_t *bp = bin_counters(hs, b);
+	for(unsigned c = 0; c < binsize; c++) {
+		uint64_t count = bp[c];
+		double mid = midpoint(hs, binsize * b + c);
+		if(rank < count) {
+			return(sum + (double)rank * mid);
+		}
+		sum += (double)count * mid;
+		rank -= count;
+	}
+	return(sum);
+}
+
+void
+hg64s_rank_range(const hg64s *hs, uint64_t lo, uint64_t hi,
+		 uint64_t *pcount, double *psum, double *pmean) {
+	uint64_t pop = hs->population;
+	lo = lo < pop ? lo : pop;
+	hi = hi < pop ? hi : pop;
+	hi = hi > lo ? hi : lo;
+	double sum = sum_below_rank(hs, hi) - sum_below_rank(hs, lo);
+	OUTARG(pcount, hi - lo);
+	OUTARG(psum, sum);
+	OUTARG(pmean, hi > lo ? sum / (double)(hi - lo) : 0.0);
+}
+
+void
+hg64s_value_range(const hg64s *hs, uint64_t lo, uint64_t hi,
+		  uint64_t *pcount, double *psum, double *pmean) {
+	hg64s_rank_range(hs,
+			 hg64s_rank_of_value(hs, lo),
+			 hg64s_rank_of_value(hs, hi),
+			 pcount, psum, pmean);
+}
+
+/**********************************************************************/
+
+/*
+ * Iterate over the non-zero buckets of a snapshot, folded into the
+ * buckets of a histogram with the same or fewer sigbits. Each bucket
+ * with fewer sigbits is the union of some buckets with more sigbits,
+ * so the folding is exact.
+ */
+struct fold {
+	const hg64s *hs;
+	const struct hg64p *hp;
+	unsigned key;
+};
+
+static bool
+fold_next(struct fold *f, unsigned *pkey, uint64_t *pcount) {
+	const hg64s *hs = f->hs;
+	unsigned binsize = BINSIZE(hs);
+	unsigned fkey = 0;
+	uint64_t count = 0;
+	while(f->key < KEYS(hs)) {
+		unsigned b = f->key / binsize;
+		unsigned c = f->key % binsize;
+		const uint64_t *bp = bin_counters(hs, b);
+		if(bp == NULL) {
+			f->key = binsize * (b + 1);
+			continue;
+		}
+		uint64_t n = bp[c];
+		if(n != 0) {
+			unsigned k = value_to_key(f->hp,
+						  key_to_minval(hs, f->key));
+			if(count != 0 && k != fkey) {
+				break;
+			}
+			fkey = k;
+			count += n;
+		}
+		f->key++;
+	}
+	*pkey = fkey;
+	*pcount = count;
+	return(count != 0);
+}
+
+/*
+ * One pass over the buckets of both snapshots in order, tracking the
+ * difference between their cumulative distribution functions.
+ */
+void
+hg64s_distance(const hg64s *a, const hg64s *b, double *pks, double *pw1) {
+	unsigned sigbits = a->sigbits < b->sigbits ? a->sigbits : b->sigbits;
+	const struct hg64p *hp = &(struct hg64p){ sigbits };
+	struct fold fa = { a, hp, 0 };
+	struct fold fb = { b, hp, 0 };
+	unsigned ka, kb;
+	uint64_t ca, cb;
+	bool more_a = fold_next(&fa, &ka, &ca);
+	bool more_b = fold_next(&fb, &kb, &cb);
+	double pop_a = a->population;
+	double pop_b = b->population;
+	uint64_t cum_a = 0, cum_b = 0;
+	double ks = 0.0, w1 = 0.0;
+	double prev_mid = 0.0, prev_diff = 0.0;
+	while(more_a || more_b) {
+		unsigned key = !more_b ? ka : !more_a ? kb : ka < kb ? ka : kb;
+		if(more_a && ka == key) {
+			cum_a += ca;
+			more_a = fold_next(&fa, &ka, &ca);
+		}
+		if(more_b && kb == key) {
+			cum_b += cb;
+			more_b = fold_next(&fb, &kb, &cb);
+		}
+		double mid = midpoint(hp, key);
+		double diff = (double)cum_a / pop_a - (double)cum_b / pop_b;
+		diff = diff < 0.0 ? -diff : diff;
+		w1 += prev_diff * (mid - prev_mid);
+		ks = ks > diff ? ks : diff;
+		prev_mid = mid;
+		prev_diff = diff;
+	}
+	OUTARG(pks, ks);
+	OUTARG(pw1, w1);
+}
+
+/*
+ * Find the values at a sequence of increasing ranks in one pass over
+ * the folded buckets of a snapshot, like value_at_rank().
+ */
+struct rank_walk {
+	struct fold f;
+	bool more;
+	unsigned key;
+	uint64_t count, below;
+};
+
+static void
+rank_walk_start(struct rank_walk *w, const hg64s *hs,
+		const struct hg64p *hp) {
+	w->f = (struct fold){ hs, hp, 0 };
+	w->below = 0;
+	w->more = fold_next(&w->f, &w->key, &w->count);
+}
+
+static uint64_t
+rank_walk_value(struct rank_walk *w, double quantile) {
+	double q = quantile < 0.0 ? 0.0 : quantile > 1.0 ? 1.0 : quantile;
+	uint64_t rank = (uint64_t)(q * (double)w->f.hs->population);
+	while(w->more && rank - w->below >= w->count) {
+		w->below += w->count;
+		w->more = fold_next(&w->f, &w->key, &w->count);
+	}
+	if(!w->more) {
+		return(UINT64_MAX);
+	}
+	uint64_t min = key_to_minval(w->f.hp, w->key);
+	uint64_t max = key_to_maxval(w->f.hp, w->key);
+	return(min + interpolate(max - min, rank - w->below, w->count));
+}
+
+/*
+ * Both snapshots are walked together, so sorted quantiles take one
+ * pass; if the quantiles go backwards, the walks start again.
+ */
+void
+hg64s_quantile_diff(const hg64s *a, const hg64s *b,
+		    const double *quantile, double *diff, size_t n) {
+	unsigned sigbits = a->sigbits < b->sigbits ? a->sigbits : b->sigbits;
+	const struct hg64p *hp = &(struct hg64p){ sigbits };
+	struct rank_walk wa, wb;
+	for(size_t i = 0; i < n; i++) {
+		if(i == 0 || quantile[i] < quantile[i - 1]) {
+			rank_walk_start(&wa, a, hp);
+			rank_walk_start(&wb, b, hp);
+		}
+		double va = rank_walk_value(&wa, quantile[i]);
+		double vb = rank_walk_value(&wb, quantile[i]);
+		diff[i] = vb - va;
+	}
+}
+
+/**********************************************************************/
+
+/*
+ * add the counts from a snapshot into another with the same or
+ * fewer sigbits; when the sigbits match this is bin-wise, otherwise
+ * the keys are folded
+ */
+static void
+snapshot_add(hg64s *out, const hg64s *in) {
+	unsigned binsize = BINSIZE(out);
+	if(out->sigbits == in->sigbits) {
+		void (*add)(uint64_t *, const uint64_t *, size_t) =
+			get_kernel()->add;
+		for(unsigned b = 0; b < BINS; b++) {
+			uint64_t *dst = bin_counters(out, b);
+			const uint64_t *src = bin_counters(in, b);
+			if(src != NULL) {
+				add(dst, src, binsize);
+			}
+		}
+	} else {
+		const struct hg64p *hp = &(struct hg64p){ out->sigbits };
+		struct fold f = { in, hp, 0 };
+		unsigned key;
+		uint64_t count;
+		while(fold_next(&f, &key, &count)) {
+			bin_counters(out, key / binsize)[key % binsize] += count;
+		}
+	}
+}
+
+/*
+ * the bins that a snapshot's non-zero counts occupy at lower precision
+ */
+static uint64_t
+snapshot_binmap(const hg64s *hs, unsigned sigbits) {
+	if(hs->sigbits == sigbits) {
+		return(hs->binmap);
+	}
+	const struct hg64p *hp = &(struct hg64p){ sigbits };
+	struct fold f = { hs, hp, 0 };
+	uint64_t binmap = 0;
+	unsigned key;
+	uint64_t count;
+	while(fold_next(&f, &key, &count)) {
+		binmap |= 1ULL << (key / BINSIZE(hp));
+	}
+	return(binmap);
+}
+
+hg64s *
+hg64s_merge(const hg64s *a, const hg64s *b) {
+	unsigned sigbits = a->sigbits < b->sigbits ? a->sigbits : b->sigbits;
+	uint64_t binmap = snapshot_binmap(a, sigbits) |
+			  snapshot_binmap(b, sigbits);
+	hg64s *hs = snapshot_alloc(sigbits, binmap, true);
+	snapshot_add(hs, a);
+	snapshot_add(hs, b);
+	count_totals(hs);
+	summarize(hs);
+	return(hs);
+}
+
+void
+hg64_merge_snapshot(hg64 *hg, const hg64s *hs) {
+	unsigned binsize = BINSIZE(hs);
+	for(unsigned b = 0; b < BINS; b++) {
+		const uint64_t *bp = bin_counters(hs, b);
+		if(bp == NULL || hs->total[b] == 0) {
+			continue;
+		}
+		for(unsigned c = 0; c < binsize; c++) {
+			unsigned key = binsize * b + c;
+			if(bp[c] == 0) {
+				continue;
+			} else if(hg->sigbits == hs->sigbits) {
+				add_key_count(hg, key, to_raw(hg, bp[c]));
+			} else {
+				put_raw(hg,
+					key_to_minval(hs, key),
+					key_to_maxval(hs, key),
+					to_raw(hg, bp[c]));
+			}
+		}
+	}
+	changed(hg);
+}
+
+/**********************************************************************/
+
+size_t
+hg64s_columns(const hg64s *hs, uint64_t *min, uint64_t *max,
+	      uint64_t *count, size_t size) {
+	unsigned binsize = BINSIZE(hs);
+	size_t i = 0;
+	for(unsigned b = 0; b < BINS; b++) {
+		const uint64_t *bp = bin_counters(hs, b);
+		if(bp == NULL || hs->total[b] == 0) {
+			continue;
+		}
+		for(unsigned c = 0; c < binsize; c++) {
+			uint64_t n = bp[c];
+			if(n == 0) {
+				continue;
+			}
+			unsigned key = binsize * b + c;
+			if(i < size && min != NULL) {
+				min[i] = key_to_minval(hs, key);
+			}
+			if(i < size && max != NULL) {
+				max[i] = key_to_maxval(hs, key);
+			}
+			if(i < size && count != NULL) {
+				count[i] = n;
+			}
+			i++;
+		}
+	}
+	return(i);
+}
+
+size_t
+hg64s_columns_many(const hg64s *const *hs, size_t n, int64_t *offsets,
+		   uint64_t *min, uint64_t *max, uint64_t *count,
+		   size_t size) {
+	size_t i = 0;
+	for(size_t s = 0; s < n; s++) {
+		size_t room = i < size ? size - i : 0;
+		OUTARG(offsets + s, (int64_t)i);
+		i += hg64s_columns(hs[s],
+				   min == NULL ? NULL : min + i,
+				   max == NULL ? NULL : max + i,
+				   count == NULL ? NULL : count + i,
+				   room);
+	}
+	OUTARG(offsets + n, (int64_t)i);
+	return(i);
+}
+
+/**********************************************************************/
+
+/*
+ * Downsampling for visualization. Log-spaced buckets are groups of
+ * consecutive keys of equal size, because keys are (roughly) the
+ * logarithms of values, so the output buckets are aligned with the
+ * histogram's buckets and no counts need to be split.
+ */
+
+static size_t
+key_group(unsigned key, unsigned klo, unsigned khi, size_t k) {
+	key = key < klo ? klo : key > khi ? khi : key;
+	return((size_t)(key - klo) * k / (khi - klo + 1));
+}
+
+/*
+ * the first key offset in group g, which is the inverse of
+ * key_group(), so it rounds up
+ */
+static inline unsigned
+group_start(size_t g, size_t span, size_t k) {
+	return((unsigned)((g * span + k - 1) / k));
+}
+
+size_t
+hg64s_log_buckets(const hg64s *hs, size_t k,
+		  uint64_t *min, uint64_t *max, uint64_t *count) {
+	const struct hg64p *hp = &(struct hg64p){ hs->sigbits };
+	struct fold f = { hs, hp, 0 };
+	unsigned key, klo = 0, khi = 0;
+	uint64_t n;
+	/* find the range of non-zero keys */
+	if(k == 0 || !fold_next(&f, &klo, &n)) {
+		return(0);
+	}
+	for(khi = klo; fold_next(&f, &key, &n); khi = key) {
+	}
+	size_t span = khi - klo + 1;
+	k = k < span ? k : span;
+	for(size_t g = 0; g < k; g++) {
+		min[g] = key_to_minval(hp, klo + group_start(g, span, k));
+		max[g] = key_to_maxval(hp, klo + group_start(g + 1, span, k) - 1);
+		count[g] = 0;
+	}
+	f.key = klo;
+	while(fold_next(&f, &key, &n)) {
+		count[key_group(key, klo, khi, k)] += n;
+	}
+	return(k);
+}
+
+size_t
+hg64s_even_buckets(const hg64s *hs, size_t k,
+		   uint64_t *min, uint64_t *max, uint64_t *count) {
+	const struct hg64p *hp = &(struct hg64p){ hs->sigbits };
+	struct fold f = { hs, hp, 0 };
+	double pop = hs->population;
+	uint64_t cum = 0, n;
+	unsigned key;
+	size_t g = 0;
+	bool empty = true;
+	while(k > 0 && fold_next(&f, &key, &n)) {
+		if(empty) {
+			min[g] = key_to_minval(hp, key);
+			count[g] = 0;
+			empty = false;
+		}
+		max[g] = key_to_maxval(hp, key);
+		count[g] += n;
+		cum += n;
+		/* the last group takes the remainder */
+		if(g + 1 < k && (double)cum * k >= (double)(g + 1) * pop) {
+			g += 1;
+			empty = true;
+		}
+	}
+	return(empty ? g : g + 1);
+}
+
+void
+hg64s_heatmap(const hg64s *const *hs, size_t n,
+	      uint64_t lo, uint64_t hi, size_t k, uint64_t *matrix) {
+	if(n == 0 || k == 0) {
+		return;
+	}
+	unsigned sigbits = hs[0]->sigbits;
+	for(size_t i = 1; i < n; i++) {
+		sigbits = sigbits < hs[i]->sigbits ? sigbits : hs[i]->sigbits;
+	}
+	const struct hg64p *hp = &(struct hg64p){ sigbits };
+	unsigned klo = value_to_key(hp, lo);
+	unsigned khi = value_to_key(hp, hi > lo ? hi : lo);
+	memset(matrix, 0, sizeof(uint64_t) * n * k);
+	for(size_t i = 0; i < n; i++) {
+		uint64_t *row = matrix + i * k;
+		struct fold f = { hs[i], hp, 0 };
+		unsigned key;
+		uint64_t count;
+		while(fold_next(&f, &key, &count)) {
+			row[key_group(key, klo, khi, k)] += count;
+		}
+	}
+}
+
+/**********************************************************************/
+
+/*
+ * Lossy compaction merges runs of adjacent buckets, moving each run's
+ * mass to its weighted median bucket. For a rank query at a boundary
+ * inside a run, the error is the mass that crossed the boundary,
+ * which is at most half the run's mass, and interpolation within a
+ * bucket cannot make it worse, so runs of at most 2 * eps * N keep
+ * rank errors within eps * N. Greedy grouping makes the fewest runs.
+ */
+
+hg64s *
+hg64s_compact(const hg64s *hs, double eps, double *perror, size_t *pbuckets) {
+	const struct hg64p *hp = &(struct hg64p){ hs->sigbits };
+	unsigned binsize = BINSIZE(hs);
+	uint64_t pop = hs->population;
+	uint64_t limit = eps <= 0.0 ? 0 :
+		eps >= 0.5 ? pop : (uint64_t)(2.0 * eps * (double)pop);
+	size_t n = 0;
+	unsigned k;
+	uint64_t count;
+	struct fold f = { hs, hp, 0 };
+	while(fold_next(&f, &k, &count)) {
+		n++;
+	}
+	unsigned *key = malloc(sizeof(unsigned) * (n + 1));
+	uint64_t *mass = malloc(sizeof(uint64_t) * (n + 1));
+	f.key = 0;
+	for(size_t i = 0; fold_next(&f, &key[i], &mass[i]); i++) {
+	}
+
+	/* results overwrite the input arrays */
+	size_t out = 0;
+	uint64_t binmap = 0, error = 0;
+	for(size_t i = 0, j; i < n; i = j) {
+		uint64_t run = mass[i];
+		for(j = i + 1; j < n && run + mass[j] <= limit; j++) {
+			run += mass[j];
+		}
+		size_t m = i;
+		uint64_t before = 0;
+		while(2 * (before + mass[m]) < run) {
+			before += mass[m++];
+		}
+		uint64_t after = run - before - mass[m];
+		uint64_t worst = before > after ? before : after;
+		error = worst > error ? worst : error;
+		key[out] = key[m];
+		mass[out] = run;
+		binmap |= 1ULL << (key[m] / binsize);
+		out++;
+	}
+
+	hg64s *cs = snapshot_alloc(hs->sigbits, binmap, true);
+	for(size_t i = 0; i < out; i++) {
+		bin_counters(cs, key[i] / binsize)[key[i] % binsize] = mass[i];
+	}
+	count_totals(cs);
+	summarize(cs);
+	free(key);
+	free(mass);
+	OUTARG(perror, pop == 0 ? 0.0 : (double)error / (double)pop);
+	OUTARG(pbuckets, out);
+	return(cs);
+}
+
+/**********************************************************************/
+
+/*
+ * For batch queries the caller makes a cumulative index of the
+ * snapshot, laid out in parallel with its counters, containing the
+ * rank of the first value in each counter, so we don't have to scan
+ * a bin per query.
+ */
+size_t
+hg64s_rank_index(const hg64s *hs, uint64_t *index, size_t size) {
+	unsigned binsize = BINSIZE(hs);
+	size_t keys = binsize * (size_t)__builtin_popcountll(hs->binmap);
+	if(keys + 1 > size) {
+		return(keys + 1);
+	}
+	uint64_t rank = 0;
+	for(size_t i = 0; i < keys; i++) {
+		index[i] = rank;
+		rank += hs->counters[i];
+	}
+	index[keys] = rank;
+	return(keys + 1);
+}
+
+/*
+ * The batch is processed in blocks so that the integer part, which
+ * involves table lookups, is separate from the floating point
+ * interpolation, which the compiler can vectorize. Without an index
+ * the integer part scans each value's bin.
+ */
+#define BLOCK 64
+
+static void
+block_rank_of_values(const hg64s *hs, const uint64_t *cum,
+		     const uint64_t *value, uint64_t *rank, size_t n) {
+	unsigned sigbits = hs->sigbits;
+	unsigned binsize = BINSIZE(hs);
+	uint64_t count[BLOCK];
+	double mul[BLOCK], div[BLOCK];
+	for(size_t i = 0; i < n; i++) {
+		/* avoid division by the run-time binsize */
+		unsigned key = value_to_key(hs, value[i]);
+		unsigned b = key >> sigbits;
+		unsigned c = key & (binsize - 1);
+		uint64_t min = b == 0 ? key : (uint64_t)(c + binsize) << (b - 1);
+		uint64_t span = UINT64_MAX/4 >> (63 - b);
+		const uint64_t *bp = bin_counters(hs, b);
+		if(bp == NULL) {
+			rank[i] = hs->below[b];
+			count[i] = 0;
+		} else if(cum != NULL) {
+			size_t j = hs->offset[b] + c;
+			rank[i] = cum[j];
+			count[i] = cum[j + 1] - cum[j];
+		} else {
+			rank[i] = hs->below[b];
+			for(unsigned k = 0; k < c; k++) {
+				rank[i] += bp[k];
+			}
+			count[i] = bp[c];
+		}
+		/* signed conversions are cheaper, and these are < 2^63 */
+		mul[i] = (double)(int64_t)(value[i] - min);
+		div[i] = (double)(int64_t)span;
+	}
+	for(size_t i = 0; i < n; i++) {
+		double frac = div[i] == 0.0 ? 1.0 : mul[i] / div[i];
+		rank[i] += (uint64_t)(int64_t)((double)(int64_t)count[i] * frac);
+	}
+}
+
+void
+hg64s_rank_of_values(const hg64s *hs, const uint64_t *index,
+		     const uint64_t *value, uint64_t *rank, size_t n) {
+	for(size_t i = 0; i < n; i += BLOCK) {
+		size_t len = n - i < BLOCK ? n - i : BLOCK;
+		block_rank_of_values(hs, index, value + i, rank + i, len);
+	}
+}
+
+void
+hg64s_quantile_of_values(const hg64s *hs, const uint64_t *index,
+			 const uint64_t *value, double *quantile, size_t n) {
+	double pop = (double)hs->population;
+	uint64_t rank[BLOCK];
+	for(size_t i = 0; i < n; i += BLOCK) {
+		size_t len = n - i < BLOCK ? n - i : BLOCK;
+		block_rank_of_values(hs, index, value + i, rank, len);
+		for(size_t j = 0; j < len; j++) {
+			quantile[i + j] = (double)rank[j] / pop;
+		}
+	}
+}
+
+/**********************************************************************/
+
+/*
+ * Archival codec. Counters are predicted from their neighbour: each
+ * counter is coded as the difference from the previous one, which is
+ * small where the distribution is smooth. The difference is mapped
+ * to a token (small values directly, larger values by bit length and
+ * the next bit down) plus raw extra bits. Tokens are entropy coded
+ * with rANS using static frequency tables, one per context, where the
+ * context is the magnitude of the previous counter, because the noise
+ * in a count grows with its size.
+ *
+ * The encoded format is:
+ *	byte: format version << 4 | sigbits
+ *	varint: lowest bin in the binmap
+ *	varint: binmap shifted down by the lowest bin
+ *	for each context:
+ *		varint: number of tokens
+ *		for each token: varint gap, varint frequency - 1
+ *	varint: length of rANS data
+ *	rANS data
+ *	extra bits, least significant first
+ */
+
+#define CODEC_VERSION 1
+#define CONTEXTS 4
+#define DIRECT 16
+#define TOKENS (DIRECT + 2 * (64 - 4))
+#define RANS_BITS 12
+#define RANS_M (1U << RANS_BITS)
+#define RANS_L (1U << 23)
+
+struct model {
+	uint16_t freq[CONTEXTS][TOKENS];
+	uint16_t cum[CONTEXTS][TOKENS];
+};
+
+struct out {
+	uint8_t *buf;
+	size_t size, pos;
+	uint64_t bits;
+	unsigned nbits;
+};
+
+struct in {
+	const uint8_t *buf;
+	size_t size, pos;
+	uint64_t bits;
+	unsigned nbits;
+	bool error;
+};
+
+static unsigned
+context(uint64_t prev) {
+	unsigned len = prev == 0 ? 0 : 64 - __builtin_clzll(prev);
+	return(len == 0 ? 0 : len <= 6 ? 1 : len <= 14 ? 2 : 3);
+}
+
+static uint64_t
+zigzag(uint64_t count, uint64_t prev) {
+	uint64_t diff = count - prev;
+	return((diff << 1) ^ (uint64_t)((int64_t)diff >> 63));
+}
+
+static uint64_t
+unzigzag(uint64_t z, uint64_t prev) {
+	return(prev + ((z >> 1) ^ (0 - (z & 1))));
+}
+
+static unsigned
+token(uint64_t z, unsigned *pextra) {
+	if(z < DIRECT) {
+		*pextra = 0;
+		return((unsigned)z);
+	}
+	unsigned len = 64 - __builtin_clzll(z);
+	*pextra = len - 2;
+	return(DIRECT + 2 * (len - 5) + ((z >> (len - 2)) & 1));
+}
+
+static uint64_t
+token_base(unsigned tok, unsigned *pextra) {
+	if(tok < DIRECT) {
+		*pextra = 0;
+		return(tok);
+	}
+	unsigned len = (tok - DIRECT) / 2 + 5;
+	*pextra = len - 2;
+	return((2ULL | ((tok - DIRECT) & 1)) << (len - 2));
+}
+
+static void
+put_byte(struct out *o, uint8_t byte) {
+	if(o->pos < o->size) {
+		o->buf[o->pos] = byte;
+	}
+	o->pos++;
+}
+
+static void
+put_varint(struct out *o, uint64_t val) {
+	while(val >= 0x80) {
+		put_byte(o, (uint8_t)(val | 0x80));
+		val >>= 7;
+	}
+	put_byte(o, (uint8_t)val);
+}
+
+static void
+put_bits(struct out *o, uint64_t val, unsigned n) {
+	if(n > 32) {
+		put_bits(o, val, 32);
+		val >>= 32;
+		n -= 32;
+	}
+	o->bits |= (val & ((1ULL << n) - 1)) << o->nbits;
+	o->nbits += n;
+	while(o->nbits >= 8) {
+		put_byte(o, (uint8_t)o->bits);
+		o->bits >>= 8;
+		o->nbits -= 8;
+	}
+}
+
+static uint8_t
+get_byte(struct in *i) {
+	if(i->pos < i->size) {
+		return(i->buf[i->pos++]);
+	}
+	i->error = true;
+	return(0);
+}
+
+static uint64_t
+get_varint(struct in *i) {
+	uint64_t val = 0;
+	for(unsigned shift = 0; shift < 64; shift += 7) {
+		uint8_t byte = get_byte(i);
+		val |= (uint64_t)(byte & 0x7f) << shift;
+		if(byte < 0x80) {
+			return(val);
+		}
+	}
+	i->error = true;
+	return(0);
+}
+
+static uint64_t
+get_bits(struct in *i, unsigned n) {
+	if(n > 32) {
+		uint64_t lo = get_bits(i, 32);
+		return(lo | get_bits(i, n - 32) << 32);
+	}
+	while(i->nbits < n) {
+		i->bits |= (uint64_t)get_byte(i) << i->nbits;
+		i->nbits += 8;
+	}
+	uint64_t val = i->bits & ((1ULL << n) - 1);
+	i->bits >>= n;
+	i->nbits -= n;
+	return(val);
+}
+
+/*
+ * scale token counts so each context's frequencies add up to RANS_M,
+ * keeping every token that occurs
+ */
+static void
+normalize(struct model *m, uint64_t count[CONTEXTS][TOKENS]) {
+	for(unsigned x = 0; x < CONTEXTS; x++) {
+		uint64_t total = 0;
+		for(unsigned t = 0; t < TOKENS; t++) {
+			total += count[x][t];
+		}
+		unsigned sum = 0;
+		for(unsigned t = 0; t < TOKENS; t++) {
+			unsigned f = 0;
+			if(count[x][t] > 0) {
+				f = (unsigned)((double)count[x][t] * RANS_M /
+					       (double)total);
+				f = f < 1 ? 1 : f;
+			}
+			m->freq[x][t] = (uint16_t)f;
+			sum += f;
+		}
+		while(total > 0 && sum != RANS_M) {
+			/* adjust the largest frequency that can move */
+			unsigned t = 0;
+			for(unsigned u = 0; u < TOKENS; u++) {
+				if(m->freq[x][u] > m->freq[x][t]) {
+					t = u;
+				}
+			}
+			if(sum > RANS_M) {
+				unsigned over = sum - RANS_M;
+				unsigned give = m->freq[x][t] - 1;
+				give = give < over ? give : over;
+				m->freq[x][t] -= (uint16_t)give;
+				sum -= give;
+				if(give == 0) {
+					break;
+				}
+			} else {
+				m->freq[x][t] += (uint16_t)(RANS_M - sum);
+				sum = RANS_M;
+			}
+		}
+		/* more occurring tokens than slots is impossible */
+		assert(total == 0 || sum == RANS_M);
+		unsigned cum = 0;
+		for(unsigned t = 0; t < TOKENS; t++) {
+			m->cum[x][t] = (uint16_t)cum;
+			cum += m->freq[x][t];
+		}
+	}
+}
+
+size_t
+hg64s_encode(const hg64s *hs, uint8_t *buf, size_t size) {
+	unsigned binsize = BINSIZE(hs);
+	size_t n = binsize * (size_t)__builtin_popcountll(hs->binmap);
+	uint8_t *tok = malloc(n + 1);
+	uint64_t (*count)[TOKENS] = calloc(CONTEXTS, sizeof(*count));
+	struct model *m = malloc(sizeof(*m));
+	/* the counters are packed in binmap order */
+	const uint64_t *counter = hs->counters;
+	uint64_t prev = 0;
+	for(size_t i = 0; i < n; i++) {
+		unsigned extra;
+		tok[i] = (uint8_t)token(zigzag(counter[i], prev), &extra);
+		count[context(prev)][tok[i]]++;
+		prev = counter[i];
+	}
+	normalize(m, count);
+
+	/* rANS works backwards, at most two bytes per token */
+	size_t rsize = 2 * n + 4;
+	uint8_t *rans = malloc(rsize);
+	uint8_t *ptr = rans + rsize;
+	uint32_t state = RANS_L;
+	for(size_t i = n; i-- > 0;) {
+		unsigned x = context(i == 0 ? 0 : counter[i - 1]);
+		uint32_t freq = m->freq[x][tok[i]];
+		uint32_t max = ((RANS_L >> RANS_BITS) << 8) * freq;
+		while(state >= max) {
+			*--ptr = (uint8_t)state;
+			state >>= 8;
+		}
+		state = ((state / freq) << RANS_BITS) + (state % freq) +
+			m->cum[x][tok[i]];
+	}
+	ptr -= 4;
+	ptr[0] = (uint8_t)(state >> 0);
+	ptr[1] = (uint8_t)(state >> 8);
+	ptr[2] = (uint8_t)(state >> 16);
+	ptr[3] = (uint8_t)(state >> 24);
+
+	struct out o = { .buf = buf, .size = size };
+	unsigned low = hs->binmap == 0 ? 0 : __builtin_ctzll(hs->binmap);
+	put_byte(&o, (uint8_t)(CODEC_VERSION << 4 | hs->sigbits));
+	put_varint(&o, low);
+	put_varint(&o, hs->binmap >> low);
+	for(unsigned x = 0; x < CONTEXTS; x++) {
+		unsigned tokens = 0, last = 0;
+		for(unsigned t = 0; t < TOKENS; t++) {
+			tokens += m->freq[x][t] > 0;
+		}
+		put_varint(&o, tokens);
+		for(unsigned t = 0; t < TOKENS; t++) {
+			if(m->freq[x][t] > 0) {
+				put_varint(&o, t - last);
+				put_varint(&o, m->freq[x][t] - 1U);
+				last = t;
+			}
+		}
+	}
+	size_t rlen = (size_t)(rans + rsize - ptr);
+	put_varint(&o, rlen);
+	for(size_t i = 0; i < rlen; i++) {
+		put_byte(&o, ptr[i]);
+	}
+	prev = 0;
+	for(size_t i = 0; i < n; i++) {
+		unsigned extra;
+		uint64_t z = zigzag(counter[i], prev);
+		token(z, &extra);
+		put_bits(&o, z, extra);
+		prev = counter[i];
+	}
+	put_bits(&o, 0, 7);
+
+	free(rans);
+	free(m);
+	free(count);
+	free(tok);
+	return(o.pos);
+}
+
+hg64s *
+hg64s_decode(const uint8_t *buf, size_t size) {
+	struct in in = { .buf = buf, .size = size };
+	uint8_t head = get_byte(&in);
+	unsigned sigbits = head & 15;
+	uint64_t low = get_varint(&in);
+	uint64_t shifted = get_varint(&in);
+	if(in.error || head >> 4 != CODEC_VERSION || sigbits < 1 ||
+	   low >= 64 || (shifted << low) >> low != shifted) {
+		return(NULL);
+	}
+	uint64_t binmap = shifted << low;
+	const struct hg64p *hp = &(struct hg64p){ sigbits };
+	if(MAXBIN(hp) < 64 && binmap >> MAXBIN(hp) != 0) {
+		return(NULL);
+	}
+
+	struct model *m = calloc(1, sizeof(*m));
+	uint8_t (*sym)[RANS_M] = calloc(CONTEXTS, sizeof(*sym));
+	for(unsigned x = 0; !in.error && x < CONTEXTS; x++) {
+		uint64_t tokens = get_varint(&in);
+		uint64_t t = 0, cum = 0;
+		for(uint64_t i = 0; !in.error && i < tokens; i++) {
+			t += get_varint(&in);
+			uint64_t freq = get_varint(&in) + 1;
+			if(t >= TOKENS || (i > 0 && m->freq[x][t] > 0) ||
+			   cum + freq > RANS_M) {
+				in.error = true;
+				break;
+			}
+			m->freq[x][t] = (uint16_t)freq;
+			m->cum[x][t] = (uint16_t)cum;
+			memset(sym[x] + cum, (int)t, freq);
+			cum += freq;
+		}
+		if(tokens > 0 && cum != RANS_M) {
+			in.error = true;
+		}
+	}
+	uint64_t rlen = get_varint(&in);
+	if(in.error || rlen < 4 || rlen > size - in.pos) {
+		free(sym);
+		free(m);
+		return(NULL);
+	}
+
+	struct in rans = { .buf = buf + in.pos, .size = rlen };
+	in.pos += rlen;
+	uint32_t state = 0;
+	for(unsigned i = 0; i < 4; i++) {
+		state |= (uint32_t)get_byte(&rans) << (8 * i);
+	}
+	hg64s *hs = snapshot_alloc(sigbits, binmap, false);
+	size_t n = BINSIZE(hp) * (size_t)__builtin_popcountll(binmap);
+	uint64_t prev = 0;
+	for(size_t i = 0; i < n; i++) {
+		unsigned x = context(prev);
+		uint32_t slot = state & (RANS_M - 1);
+		unsigned t = sym[x][slot];
+		uint32_t freq = m->freq[x][t];
+		if(freq == 0) {
+			in.error = true;
+			break;
+		}
+		state = freq * (state >> RANS_BITS) + slot - m->cum[x][t];
+		while(state < RANS_L && !rans.error) {
+			state = state << 8 | get_byte(&rans);
+		}
+		unsigned extra;
+		uint64_t z = token_base(t, &extra);
+		z |= get_bits(&in, extra);
+		hs->counters[i] = prev = unzigzag(z, prev);
+	}
+	free(sym);
+	free(m);
+	if(in.error || rans.error) {
+		free(hs);
+		return(NULL);
+	}
+	count_totals(hs);
+	summarize(hs);
+	return(hs);
+}
+
+/**********************************************************************/
+
+/*
+ * A series is a sequence of frames, each of which is a varint length
+ * followed by a type byte. A keyframe contains a snapshot in archival
+ * format. A delta frame records the changes since the previous frame,
+ * coded as the difference between each counter's change and its
+ * previous change (delta-of-delta, as in Gorilla), so counters that
+ * change at a steady rate, or not at all, cost nothing. Only bins with
+ * changes are listed, using a bitmask, and within each bin only the
+ * changed counters are listed, by position.
+ *
+ *	byte: format version << 4 | sigbits
+ *	frames:
+ *		varint: frame length
+ *		byte: frame type, KEYFRAME or DELTA | NEWBINS
+ *		keyframe: hg64s_encode() output
+ *		delta frame:
+ *			varint: binmap, if NEWBINS
+ *			varint: bitmask of changed bins
+ *			for each changed bin:
+ *				varint: number of changes
+ *				for each change: varint gap, zigzag varint
+ */
+
+#define KEYFRAME 0
+#define DELTA 1
+#define NEWBINS 2
+
+/* the longest varint */
+#define VARINT 10
+
+/*
+ * per-bin current values and their most recent changes
+ */
+struct series_state {
+	unsigned sigbits;
+	uint64_t binmap;
+	uint64_t *val[BINS];
+	uint64_t *dif[BINS];
+};
+
+struct hg64series {
+	struct series_state st;
+	unsigned keyframe;
+	size_t frames;
+	uint8_t *buf;
+	size_t size, cap;
+};
+
+static void
+state_bin(struct series_state *st, unsigned b) {
+	if(st->val[b] == NULL) {
+		unsigned binsize = BINSIZE(&(struct hg64p){ st->sigbits });
+		st->val[b] = calloc(2 * binsize, sizeof(uint64_t));
+		st->dif[b] = st->val[b] + binsize;
+	}
+}
+
+static void
+state_free(struct series_state *st) {
+	for(unsigned b = 0; b < BINS; b++) {
+		free(st->val[b]);
+	}
+}
+
+/*
+ * reset the state to a keyframe
+ */
+static void
+state_load(struct series_state *st, const hg64s *hs) {
+	unsigned binsize = BINSIZE(hs);
+	for(unsigned b = 0; b < BINS; b++) {
+		const uint64_t *bp = bin_counters(hs, b);
+		if(bp != NULL || st->val[b] != NULL) {
+			state_bin(st, b);
+			for(unsigned c = 0; c < binsize; c++) {
+				st->val[b][c] = bp != NULL ? bp[c] : 0;
+				st->dif[b][c] = 0;
+			}
+		}
+	}
+	st->binmap = hs->binmap;
+}
+
+static hg64s *
+state_snapshot(struct series_state *st) {
+	unsigned binsize = BINSIZE(&(struct hg64p){ st->sigbits });
+	hg64s *hs = snapshot_alloc(st->sigbits, st->binmap, false);
+	for(unsigned b = 0; b < BINS; b++) {
+		uint64_t *bp = bin_counters(hs, b);
+		if(bp != NULL) {
+			state_bin(st, b);
+			memcpy(bp, st->val[b], binsize * sizeof(uint64_t));
+		}
+	}
+	count_totals(hs);
+	summarize(hs);
+	return(hs);
+}
+
+hg64series *
+hg64series_create(unsigned sigbits, unsigned keyframe) {
+	if(sigbits < 1 || sigbits > 15 || keyframe == 0) {
+		return(NULL);
+	}
+	hg64series *ts = calloc(1, sizeof(*ts));
+	ts->st.sigbits = sigbits;
+	ts->keyframe = keyframe;
+	ts->cap = 1024;
+	ts->buf = malloc(ts->cap);
+	ts->buf[ts->size++] = (uint8_t)(CODEC_VERSION << 4 | sigbits);
+	return(ts);
+}
+
+void
+hg64series_destroy(hg64series *ts) {
+	state_free(&ts->st);
+	free(ts->buf);
+	free(ts);
+}
+
+const uint8_t *
+hg64series_data(const hg64series *ts, size_t *psize) {
+	*psize = ts->size;
+	return(ts->buf);
+}
+
+static void
+series_reserve(hg64series *ts, size_t len) {
+	while(ts->cap - ts->size < len) {
+		ts->cap *= 2;
+		ts->buf = realloc(ts->buf, ts->cap);
+	}
+}
+
+/*
+ * write the frame after space for its length, then move it down
+ */
+static size_t
+delta_frame(hg64series *ts, const hg64s *hs, uint8_t *buf) {
+	struct series_state *st = &ts->st;
+	unsigned binsize = BINSIZE(hs);
+	uint64_t bins = st->binmap | hs->binmap;
+	uint64_t changed = 0;
+	struct out o = { .buf = buf, .size = SIZE_MAX };
+	put_byte(&o, DELTA | (hs->binmap != st->binmap ? NEWBINS : 0));
+	if(hs->binmap != st->binmap) {
+		put_varint(&o, hs->binmap);
+	}
+	/* the bitmask goes here when we know what it is */
+	size_t mask = o.pos;
+	o.pos += VARINT;
+	for(unsigned b = 0; b < BINS; b++) {
+		if((bins & (1ULL << b)) == 0) {
+			continue;
+		}
+		state_bin(st, b);
+		uint64_t *val = st->val[b], *dif = st->dif[b];
+		const uint64_t *now = bin_counters(hs, b);
+		size_t count = o.pos;
+		unsigned changes = 0, last = 0;
+		o.pos += VARINT;
+		for(unsigned c = 0; c < binsize; c++) {
+			uint64_t d = (now == NULL ? 0 : now[c]) - val[c];
+			if(d != dif[c]) {
+				put_varint(&o, c - last);
+				put_varint(&o, zigzag(d, dif[c]));
+				last = c;
+				changes++;
+			}
+			val[c] += d;
+			dif[c] = d;
+		}
+		if(changes == 0) {
+			o.pos = count;
+			continue;
+		}
+		changed |= 1ULL << b;
+		struct out n = { .buf = buf + count, .size = VARINT };
+		put_varint(&n, changes);
+		memmove(buf + count + n.pos, buf + count + VARINT,
+			o.pos - count - VARINT);
+		o.pos -= VARINT - n.pos;
+	}
+	struct out m = { .buf = buf + mask, .size = VARINT };
+	put_varint(&m, changed);
+	memmove(buf + mask + m.pos, buf + mask + VARINT,
+		o.pos - mask - VARINT);
+	o.pos -= VARINT - m.pos;
+	st->binmap = hs->binmap;
+	return(o.pos);
+}
+
+/*
+ * Encode the keyframe straight into the spare space after the frame
+ * length, and again if the space was too small; the buffer doubles,
+ * so that is rare.
+ */
+static size_t
+key_frame(hg64series *ts, const hg64s *hs) {
+	series_reserve(ts, VARINT + 1);
+	size_t room = ts->cap - ts->size - VARINT - 1;
+	size_t len = hg64s_encode(hs, ts->buf + ts->size + VARINT + 1, room);
+	if(len > room) {
+		series_reserve(ts, VARINT + 1 + len);
+		hg64s_encode(hs, ts->buf + ts->size + VARINT + 1, len);
+	}
+	ts->buf[ts->size + VARINT] = KEYFRAME;
+	state_load(&ts->st, hs);
+	return(1 + len);
+}
+
+/*
+ * count the counters that a delta frame will list
+ */
+static size_t
+delta_changes(const struct series_state *st, const hg64s *hs) {
+	unsigned binsize = BINSIZE(hs);
+	uint64_t bins = st->binmap | hs->binmap;
+	size_t changes = 0;
+	for(unsigned b = 0; b < BINS; b++) {
+		if((bins & (1ULL << b)) == 0) {
+			continue;
+		}
+		const uint64_t *val = st->val[b], *dif = st->dif[b];
+		const uint64_t *now = bin_counters(hs, b);
+		for(unsigned c = 0; c < binsize; c++) {
+			uint64_t d = (now == NULL ? 0 : now[c]) -
+				     (val == NULL ? 0 : val[c]);
+			changes += d != (dif == NULL ? 0 : dif[c]);
+		}
+	}
+	return(changes);
+}
+
+int
+hg64series_append(hg64series *ts, const hg64s *hs) {
+	if(hs->sigbits != ts->st.sigbits) {
+		return(-1);
+	}
+	size_t len;
+	if(ts->frames % ts->keyframe == 0) {
+		len = key_frame(ts, hs);
+	} else {
+		/* a gap is at most 3 bytes, and each bin has a count */
+		unsigned bins = __builtin_popcountll(ts->st.binmap |
+						     hs->binmap);
+		series_reserve(ts, VARINT + 1 + VARINT * (2 + bins) +
+			       (3 + VARINT) * delta_changes(&ts->st, hs));
+		len = delta_frame(ts, hs, ts->buf + ts->size + VARINT);
+	}
+	uint8_t *frame = ts->buf + ts->size + VARINT;
+	struct out o = { .buf = ts->buf, .size = ts->cap, .pos = ts->size };
+	put_varint(&o, len);
+	memmove(ts->buf + o.pos, frame, len);
+	ts->size = o.pos + len;
+	ts->frames++;
+	return(0);
+}
+
+/*
+ * apply a frame to the decoder state
+ */
+static bool
+apply_frame(struct series_state *st, const uint8_t *buf, size_t len) {
+	unsigned binsize = BINSIZE(&(struct hg64p){ st->sigbits });
+	struct in in = { .buf = buf, .size = len };
+	uint8_t type = get_byte(&in);
+	if(type == KEYFRAME) {
+		hg64s *hs = hg64s_decode(buf + 1, len - 1);
+		if(hs == NULL || hs->sigbits != st->sigbits) {
+			free(hs);
+			return(false);
+		}
+		state_load(st, hs);
+		free(hs);
+		return(true);
+	}
+	if((type & ~NEWBINS) != DELTA) {
+		return(false);
+	}
+	uint64_t binmap = (type & NEWBINS) ? get_varint(&in) : st->binmap;
+	uint64_t changed = get_varint(&in);
+	uint64_t bins = st->binmap | binmap;
+	if(in.error || (changed & ~bins) != 0 ||
+	   (MAXBIN(st) < 64 && bins >> MAXBIN(st) != 0)) {
+		return(false);
+	}
+	for(unsigned b = 0; b < BINS; b++) {
+		if((bins & (1ULL << b)) == 0) {
+			continue;
+		}
+		state_bin(st, b);
+		uint64_t *val = st->val[b], *dif = st->dif[b];
+		uint64_t changes = 0, next = UINT64_MAX;
+		if(changed & (1ULL << b)) {
+			changes = get_varint(&in);
+			next = changes > 0 ? get_varint(&in) : UINT64_MAX;
+		}
+		for(unsigned c = 0; c < binsize; c++) {
+			if(c == next) {
+				dif[c] = unzigzag(get_varint(&in), dif[c]);
+				next = --changes > 0 ? c + get_varint(&in)
+						     : UINT64_MAX;
+			}
+			val[c] += dif[c];
+		}
+		if(changes > 0 || in.error) {
+			return(false);
+		}
+	}
+	st->binmap = binmap;
+	return(in.pos == len);
+}
+
+/*
+ * Decode frames up to `to`, starting from the last keyframe at or
+ * before `from`, and calling `each` with the state after every frame
+ * from `from` onwards. Returns false if the data is malformed or
+ * there are not enough frames.
+ */
+static bool
+series_scan(const uint8_t *buf, size_t size, size_t from, size_t to,
+	    struct series_state *st,
+	    void (*each)(struct series_state *st, void *arg), void *arg) {
+	struct in in = { .buf = buf, .size = size };
+	uint8_t head = get_byte(&in);
+	st->sigbits = head & 15;
+	if(in.error || head >> 4 != CODEC_VERSION || st->sigbits < 1) {
+		return(false);
+	}
+	/* find the starting keyframe */
+	size_t start = in.pos, frame = 0, key = 0;
+	while(frame <= from) {
+		size_t pos = in.pos;
+		uint64_t len = get_varint(&in);
+		if(in.error || len == 0 || len > size - in.pos) {
+			return(false);
+		}
+		if(buf[in.pos] == KEYFRAME) {
+			start = pos;
+			key = frame;
+		}
+		in.pos += len;
+		frame++;
+	}
+	in.pos = start;
+	for(frame = key; frame < to; frame++) {
+		uint64_t len = get_varint(&in);
+		if(in.error || len == 0 || len > size - in.pos ||
+		   !apply_frame(st, buf + in.pos, len)) {
+			return(false);
+		}
+		in.pos += len;
+		if(frame >= from && each != NULL) {
+			each(st, arg);
+		}
+	}
+	return(true);
+}
+
+size_t
+hg64series_count(const uint8_t *buf, size_t size) {
+	struct in in = { .buf = buf, .size = size, .pos = 1 };
+	size_t frames = 0;
+	while(in.pos < size) {
+		uint64_t len = get_varint(&in);
+		if(in.error || len > size - in.pos) {
+			break;
+		}
+		in.pos += len;
+		frames++;
+	}
+	return(frames);
+}
+
+hg64s *
+hg64series_point(const uint8_t *buf, size_t size, size_t i) {
+	struct series_state st = { 0 };
+	hg64s *hs = NULL;
+	if(series_scan(buf, size, i, i + 1, &st, NULL, NULL)) {
+		hs = state_snapshot(&st);
+	}
+	state_free(&st);
+	return(hs);
+}
+
+struct series_sum {
+	uint64_t binmap;
+	uint64_t *sum[BINS];
+};
+
+static void
+add_state(struct series_state *st, void *arg) {
+	struct series_sum *acc = arg;
+	unsigned binsize = BINSIZE(&(struct hg64p){ st->sigbits });
+	for(unsigned b = 0; b < BINS; b++) {
+		if((st->binmap & (1ULL << b)) == 0) {
+			continue;
+		}
+		if(acc->sum[b] == NULL) {
+			acc->sum[b] = calloc(binsize, sizeof(uint64_t));
+		}
+		for(unsigned c = 0; c < binsize; c++) {
+			acc->sum[b][c] += st->val[b][c];
+		}
+	}
+	acc->binmap |= st->binmap;
+}
+
+hg64s *
+hg64series_sum(const uint8_t *buf, size_t size, size_t from, size_t to) {
+	struct series_state st = { 0 };
+	struct series_sum acc = { 0 };
+	hg64s *hs = NULL;
+	if(from < to &&
+	   series_scan(buf, size, from, to, &st, add_state, &acc)) {
+		unsigned binsize = BINSIZE(&(struct hg64p){ st.sigbits });
+		hs = snapshot_alloc(st.sigbits, acc.binmap, false);
+		for(unsigned b = 0; b < BINS; b++) {
+			uint64_t *bp = bin_counters(hs, b);
+			if(bp != NULL) {
+				memcpy(bp, acc.sum[b], binsize * sizeof(uint64_t));
+			}
+		}
+		count_totals(hs);
+		summarize(hs);
+	}
+	for(unsigned b = 0; b < BINS; b++) {
+		free(acc.sum[b]);
+	}
+	state_free(&st);
+	return(hs);
+}
+
+/**********************************************************************/
+
+/*
+ * OpenTelemetry exponential histograms have 2^scale buckets per
+ * octave, with boundaries at powers of 2^(2^-scale), and bucket `i`
+ * holds values in (base^i, base^(i+1)]. Our buckets are linear within
+ * each octave, so they cannot line up exactly; we use scale = sigbits
+ * - 1, which gives each exponential bucket one to three of ours, and
+ * move each of our buckets whole into the exponential bucket that
+ * contains its centre. Exact small values are placed exactly.
+ *
+ * The index of a bucket within its octave depends only on its
+ * mantissa, so it comes from a table, which is calculated without
+ * libm: floor(2^scale * log2(m)) is the exponent of m^(2^scale),
+ * which we get by repeated squaring.
+ */
+
+#define PB_VARINT 0
+#define PB_I64 1
+#define PB_LEN 2
+
+struct otlp {
+	unsigned scale;
+	/* indexes for exact values and for bucket centres */
+	int *exact, *centre;
+};
+
+static int
+octave_index(double m, unsigned scale) {
+	int e = 0;
+	for(unsigned i = 0; i < scale; i++) {
+		m = m * m;
+		e = e * 2;
+		if(m >= 2.0) {
+			m = m / 2.0;
+			e = e + 1;
+		}
+	}
+	return(e);
+}
+
+static void
+otlp_tables(struct otlp *t, unsigned sigbits) {
+	unsigned binsize = BINSIZE(&(struct hg64p){ sigbits });
+	t->scale = sigbits - 1;
+	t->exact = malloc(sizeof(int) * binsize * 2);
+	t->centre = t->exact + binsize;
+	for(unsigned c = 0; c < binsize; c++) {
+		double m = (double)(binsize + c) / binsize;
+		double mid = (binsize + c + 0.5) / binsize;
+		/* a power of two is the top of the previous bucket */
+		t->exact[c] = c == 0 ? -1 : octave_index(m, t->scale);
+		t->centre[c] = octave_index(mid, t->scale);
+	}
+}
+
+static int64_t
+otlp_index(const struct otlp *t, unsigned sigbits, unsigned b, unsigned c) {
+	int64_t per = 1LL << t->scale;
+	if(b == 0) {
+		unsigned e = 31 - __builtin_clz(c);
+		unsigned r = (c - (1U << e)) << (sigbits - e);
+		return(e * per + t->exact[r]);
+	} else if(b == 1) {
+		return(sigbits * per + t->exact[c]);
+	} else {
+		return((sigbits + b - 1) * per + t->centre[c]);
+	}
+}
+
+static void
+put_tag(struct out *o, unsigned field, unsigned wire) {
+	put_varint(o, field << 3 | wire);
+}
+
+static void
+put_fixed64(struct out *o, uint64_t val) {
+	for(unsigned i = 0; i < 8; i++) {
+		put_byte(o, (uint8_t)(val >> (8 * i)));
+	}
+}
+
+static void
+put_double(struct out *o, double val) {
+	uint64_t bits;
+	memcpy(&bits, &val, sizeof(bits));
+	put_fixed64(o, bits);
+}
+
+/*
+ * write the packed bucket counts, starting from the first non-zero
+ * bucket, and return its index
+ */
+static int64_t
+otlp_counts(const hg64s *hs, const struct otlp *t, struct out *o) {
+	unsigned binsize = BINSIZE(hs);
+	int64_t first = 0, cur = 0;
+	uint64_t acc = 0;
+	bool started = false;
+	for(unsigned b = 0; b < MAXBIN(hs); b++) {
+		const uint64_t *bp = bin_counters(hs, b);
+		if(bp == NULL || hs->total[b] == 0) {
+			continue;
+		}
+		for(unsigned c = (b == 0); c < binsize; c++) {
+			if(bp[c] == 0) {
+				continue;
+			}
+			int64_t i = otlp_index(t, hs->sigbits, b, c);
+			if(!started) {
+				first = cur = i;
+				started = true;
+			}
+			for(; cur < i; cur++) {
+				put_varint(o, acc);
+				acc = 0;
+			}
+			acc += bp[c];
+		}
+	}
+	if(started) {
+		put_varint(o, acc);
+	}
+	return(first);
+}
+
+size_t
+hg64s_otlp(const hg64s *hs, uint64_t start, uint64_t time,
+	   uint8_t *buf, size_t size) {
+	struct otlp t;
+	otlp_tables(&t, hs->sigbits);
+	const uint64_t *zero = bin_counters(hs, 0);
+	uint64_t zeros = zero == NULL ? 0 : zero[0];
+	/* measure the nested fields first */
+	struct out counts = { 0 };
+	int64_t offset = otlp_counts(hs, &t, &counts);
+	struct out positive = { 0 };
+	put_tag(&positive, 1, PB_VARINT);
+	put_varint(&positive, (uint64_t)(offset << 1) ^
+				      (uint64_t)(offset >> 63));
+	if(counts.pos > 0) {
+		put_tag(&positive, 2, PB_LEN);
+		put_varint(&positive, counts.pos);
+		positive.pos += counts.pos;
+	}
+
+	struct out o = { .buf = buf, .size = size };
+	put_tag(&o, 2, PB_I64);
+	put_fixed64(&o, start);
+	put_tag(&o, 3, PB_I64);
+	put_fixed64(&o, time);
+	put_tag(&o, 4, PB_I64);
+	put_fixed64(&o, hs->population);
+	if(hs->population > 0) {
+		put_tag(&o, 5, PB_I64);
+		put_double(&o, hs->sum);
+	}
+	put_tag(&o, 6, PB_VARINT);
+	put_varint(&o, t.scale << 1);
+	put_tag(&o, 7, PB_I64);
+	put_fixed64(&o, zeros);
+	put_tag(&o, 8, PB_LEN);
+	put_varint(&o, positive.pos);
+	put_tag(&o, 1, PB_VARINT);
+	put_varint(&o, (uint64_t)(offset << 1) ^ (uint64_t)(offset >> 63));
+	if(counts.pos > 0) {
+		put_tag(&o, 2, PB_LEN);
+		put_varint(&o, counts.pos);
+		otlp_counts(hs, &t, &o);
+	}
+	struct fold f = { hs, &(struct hg64p){ hs->sigbits }, 0 };
+	unsigned lo, hi, key;
+	uint64_t n;
+	if(fold_next(&f, &lo, &n)) {
+		for(hi = lo; fold_next(&f, &key, &n); hi = key) {
+		}
+		put_tag(&o, 12, PB_I64);
+		put_double(&o, (double)key_to_minval(hs, lo));
+		put_tag(&o, 13, PB_I64);
+		put_double(&o, (double)key_to_maxval(hs, hi));
+	}
+	free(t.exact);
+	return(o.pos);
 }
 
 /**********************************************************************/
@@ -14,6 +14,10 @@
 
 typedef struct hg64 hg64;
 typedef struct hg64s hg64s;
+typedef struct hg64t hg64t;
+typedef struct hg64pool hg64pool;
+typedef struct hg64pub hg64pub;
+typedef struct hg64series hg64series;
 
 /*
  * Allocate a new histogram. `sigbits` must be between 1 and 15
@@ -22,11 +26,76 @@ typedef struct hg64s hg64s;
  */
 hg64 *hg64_create(unsigned sigbits);
 
+/*
+ * Allocate a new histogram that maintains running totals for each bin
+ * and for the whole population as values are added. This makes
+ * updates a little slower, but the live rank and quantile functions
+ * below can skip whole bins instead of scanning every counter, so it
+ * is worth it if the histogram is queried much more often than
+ * snapshots are taken.
+ */
+hg64 *hg64_create_totals(unsigned sigbits);
+
+/*
+ * Allocate a new weighted histogram. Its counters are fixed-point
+ * numbers with 20 fractional bits, so it can record values with
+ * fractional weights using `hg64_add_weight()`, up to a total weight
+ * of about 2^44 per bucket. Otherwise it works the same as a normal
+ * histogram: counts are rounded to the nearest whole number when they
+ * are retrieved, and snapshots carry fractions from each bucket to the
+ * next so that the population is the total weight rounded down.
+ */
+hg64 *hg64_create_weighted(unsigned sigbits);
+
 /*
  * Free the memory used by a histogram
  */
 void hg64_destroy(hg64 *hg);
 
+/*
+ * Make a copy of a histogram cheaply, by sharing its bins of counters
+ * with the copy. A bin is copied when either histogram first writes
+ * to it, so memory usage is proportional to the difference between
+ * the two histograms. The histogram must not be updated concurrently
+ * with cloning it. A shared bin that is no longer used is freed after
+ * every histogram that shared it has called `hg64_reclaim()` or
+ * `hg64_destroy()`, so each histogram only needs its own threads to
+ * be quiescent, as described below.
+ */
+hg64 *hg64_clone(hg64 *hg);
+
+/*
+ * Set all the histogram's counts to zero, without freeing its bins
+ * of counters, so it can be re-used without allocating memory. This
+ * does not forget any SLO thresholds. Values that are added
+ * concurrently may or may not be cleared.
+ */
+void hg64_clear(hg64 *hg);
+
+/*
+ * Remove bins of counters that are all zero, typically after
+ * `hg64_clear()`, so that a temporary spike of unusual values does
+ * not use memory for the lifetime of the histogram. Returns the
+ * number of bins removed.
+ *
+ * Other threads may still be using the removed bins, so they are not
+ * freed until `hg64_reclaim()` is called. This function must not be
+ * called concurrently with itself or `hg64_reclaim()`.
+ */
+size_t hg64_compact(hg64 *hg);
+
+/*
+ * Free the bins removed by `hg64_compact()`, after moving any counts
+ * that were added to them late into the live histogram, and drop
+ * this histogram's references to bins it no longer shares. Call this
+ * after every thread that was using the histogram (to update it or
+ * read it) when `hg64_compact()` was called has since finished what
+ * it was doing, e.g. the thread has finished handling its current
+ * request. Before the next call to `hg64_compact()` is often a
+ * convenient time, if compaction is infrequent.
+ */
+void hg64_reclaim(hg64 *hg);
+
 /*
  * Get the histogram's `sigbits` setting
  */
@@ -47,6 +116,23 @@ void hg64_inc(hg64 *hg, uint64_t value);
  */
 void hg64_add(hg64 *hg, uint64_t value, uint64_t inc);
 
+/*
+ * Add a fractional weight to the value's counter. The weight is
+ * rounded to a whole number unless the histogram is weighted. A
+ * weight that is NaN or not positive adds nothing; a weight that is
+ * too large for one counter (2^44 in a weighted histogram, 2^64
+ * otherwise) adds the largest whole count that a counter can hold.
+ */
+void hg64_add_weight(hg64 *hg, uint64_t value, double weight);
+
+/*
+ * Add 1 to the counter of each of the `n` values. This is faster
+ * than calling `hg64_inc()` in a loop, because the values are
+ * converted to keys in blocks using the best vector instructions
+ * that the CPU supports.
+ */
+void hg64_add_array(hg64 *hg, const uint64_t *value, size_t n);
+
 /*
  * Add a data point, such as one imported from elsewhere. Values
  * between `min` and `max` inclusive occurred `count` times. This
@@ -88,6 +174,14 @@ unsigned hg64_next(hg64 *hg, unsigned key);
  */
 void hg64_merge(hg64 *target, hg64 *source);
 
+/*
+ * Multiply all the counts in the histogram by `factor`, for instance
+ * to correct for sampling. Rounding errors are carried from each
+ * counter to the next, so the population is scaled accurately. Values
+ * that are added concurrently may or may not be scaled.
+ */
+void hg64_scale(hg64 *hg, double factor);
+
 /*
  * Get summary statistics about the histogram.
  *
@@ -98,15 +192,223 @@ void hg64_merge(hg64 *target, hg64 *source);
  */
 void hg64_mean_variance(hg64 *hg, double *pmean, double *pvar);
 
+/*
+ * A pool of histograms that can be recycled without allocating
+ * memory. Histograms are created by calling `create(sigbits)`, for
+ * example, `hg64_create` or `hg64_create_totals`, when the pool is
+ * empty. The pool keeps up to `limit` unused histograms. Pools are
+ * thread-safe.
+ */
+hg64pool *hg64pool_create(hg64 *(*create)(unsigned sigbits),
+			  unsigned sigbits, size_t limit);
+
+/*
+ * Destroy a pool and the unused histograms in it.
+ */
+void hg64pool_destroy(hg64pool *pool);
+
+/*
+ * Get an empty histogram from the pool.
+ */
+hg64 *hg64pool_get(hg64pool *pool);
+
+/*
+ * Return a histogram to the pool. It is cleared, and its bins are
+ * kept for re-use, and any SLO thresholds are removed. If the pool
+ * is full, the histogram is destroyed.
+ */
+void hg64pool_put(hg64pool *pool, hg64 *hg);
+
+/*
+ * Get the number of values recorded in the histogram.
+ */
+uint64_t hg64_population(hg64 *hg);
+
+/*
+ * Get the sum of the histogram's counters without rounding. This is
+ * the same as the population unless the histogram is weighted, when
+ * it is in units of 2^-20, so it changes whenever a weight is added.
+ */
+uint64_t hg64_raw_population(hg64 *hg);
+
+/*
+ * Get a number that changes whenever the histogram's counts change
+ * other than by adding values: `hg64_clear()`, `hg64_compact()`,
+ * `hg64_reclaim()`, `hg64_merge()`, `hg64_merge_snapshot()`, and
+ * `hg64_scale()`. If neither this nor the raw population has
+ * changed, a snapshot would be the same as before, so a cached
+ * rendering of the histogram is still valid.
+ */
+uint64_t hg64_generation(hg64 *hg);
+
+/*
+ * Rank and quantile calculations on a live histogram; these work
+ * like the `hg64s_*()` functions below. They are fast when the
+ * histogram was created by `hg64_create_totals()`, otherwise they
+ * have to scan every counter. Concurrent updates can make the
+ * results inconsistent, in which case `hg64_value_at_rank()` and
+ * `hg64_value_at_quantile()` may return `UINT64_MAX`.
+ */
+uint64_t hg64_value_at_rank(hg64 *hg, uint64_t rank);
+uint64_t hg64_value_at_quantile(hg64 *hg, double quantile);
+uint64_t hg64_rank_of_value(hg64 *hg, uint64_t value);
+double hg64_quantile_of_value(hg64 *hg, uint64_t value);
+
+/*
+ * Register an SLO threshold, such as "99% of requests take less than
+ * 200ms", and return its number, or -1 if the histogram already has
+ * the maximum of 8 thresholds. Each update that is over the threshold
+ * also increments the threshold's counter. The threshold is rounded
+ * up to the maximum value of its bucket. Register thresholds before
+ * the histogram is updated concurrently, otherwise the initial count
+ * of values over the threshold can be inaccurate.
+ */
+int hg64_threshold(hg64 *hg, uint64_t value);
+
+/*
+ * Get the threshold's value after rounding
+ */
+uint64_t hg64_threshold_value(hg64 *hg, unsigned threshold);
+
+/*
+ * Get the number of values recorded that are over the threshold
+ */
+uint64_t hg64_threshold_count(hg64 *hg, unsigned threshold);
+
+/*
+ * Get the fraction of values recorded that are over the threshold.
+ * This is fast when the histogram maintains its population, i.e. it
+ * was created by `hg64_create_totals()`. The SLO burn rate is this
+ * ratio divided by the error budget, e.g. (1 - 0.99).
+ */
+double hg64_threshold_ratio(hg64 *hg, unsigned threshold);
+
+/*
+ * A quantile tracker follows a few quantiles of a histogram as values
+ * are added, so their values are always up to date without repeated
+ * rank calculations. A tracker is not thread-safe, and all updates to
+ * the histogram must go through the tracker.
+ */
+hg64t *hg64t_create(hg64 *hg);
+
+/*
+ * Free the memory used by a tracker (but not its histogram)
+ */
+void hg64t_destroy(hg64t *t);
+
+/*
+ * Called when a watched quantile's value moves above or below its
+ * threshold; `watch` is the number returned by `hg64t_watch()`
+ */
+typedef void hg64t_cb(void *arg, unsigned watch, uint64_t value, bool above);
+
+/*
+ * Start tracking a quantile. When its value becomes greater than
+ * `threshold`, or falls back to less than or equal, `cb` is called
+ * (if it is non-NULL) with `arg`. Returns a number that identifies
+ * this quantile in calls to the other `hg64t_*()` functions.
+ */
+unsigned hg64t_watch(hg64t *t, double quantile, uint64_t threshold,
+		     hg64t_cb *cb, void *arg);
+
+/*
+ * Add an arbitrary increment to the value's counter and move
+ * the tracked quantiles accordingly.
+ */
+void hg64t_add(hg64t *t, uint64_t value, uint64_t inc);
+
+/*
+ * Get the current approximate value of a tracked quantile
+ */
+uint64_t hg64t_value(hg64t *t, unsigned watch);
+
+/*
+ * Is the tracked quantile's value above its threshold?
+ */
+bool hg64t_above(hg64t *t, unsigned watch);
+
 /*
  * Get a snapshot of a histogram for rank and quantile calculations.
  * When you have finished with it, just free() it.
  */
 hg64s *hg64_snapshot(hg64 *hg);
 
+/*
+ * Save a snapshot into `buffer`, which has `size` bytes available
+ * and is suitably aligned for a `uint64_t`. Returns the number of
+ * bytes required; if the return value is greater than `size` nothing
+ * has been written. The saved snapshot includes the summary data, so
+ * it can be mapped back into memory and queried in place.
+ *
+ * The format is the in-memory layout, so it can only be read on a
+ * machine with the same byte order and alignment; for a portable and
+ * much smaller format, use `hg64s_encode()`.
+ */
+size_t hg64s_save(const hg64s *hs, void *buffer, size_t size);
+
+/*
+ * Use a saved snapshot in place, e.g. after reading it into memory or
+ * mapping it from a file, which can be read-only. This takes constant
+ * time: it checks the header and the bin totals, but not the counts.
+ * Returns NULL if the buffer is misaligned or does not contain a
+ * valid saved snapshot of exactly `size` bytes. Do not free() the
+ * result.
+ */
+const hg64s *hg64s_map(const void *buffer, size_t size);
+
+/*
+ * A publisher takes a snapshot of a histogram every `ms` milliseconds
+ * in a background thread, so that several readers can share the same
+ * snapshot without copying. Returns NULL if `ms` is zero or the
+ * thread could not be started. The first snapshot is taken before
+ * `hg64pub_create()` returns.
+ */
+hg64pub *hg64pub_create(hg64 *hg, unsigned ms);
+
+/*
+ * Stop the publisher thread and release its snapshot. Snapshots that
+ * readers still hold remain valid until they are put back.
+ */
+void hg64pub_destroy(hg64pub *pub);
+
+/*
+ * Publish a new snapshot now, without waiting for the next tick.
+ * Publishing never waits for readers.
+ */
+void hg64pub_refresh(hg64pub *pub);
+
+/*
+ * Get the latest published snapshot, which remains valid until it is
+ * released with `hg64pub_put()`. This does not copy or block: it is
+ * usually one atomic increment. Do not free() the snapshot.
+ */
+const hg64s *hg64pub_get(hg64pub *pub);
+
+/*
+ * Release a snapshot obtained from `hg64pub_get()`. It is freed when
+ * it has been superseded and all its readers have released it.
+ */
+void hg64pub_put(const hg64s *hs);
+
+/*
+ * Make a new snapshot containing the counts from two snapshots. If
+ * they have different `sigbits` settings, the result has the lower
+ * precision. When you have finished with it, just free() it.
+ */
+hg64s *hg64s_merge(const hg64s *a, const hg64s *b);
+
+/*
+ * Increase the counts in a histogram by the counts in a snapshot.
+ */
+void hg64_merge_snapshot(hg64 *hg, const hg64s *hs);
+
 /*
  * Get the approximate value at a given rank in the recorded data.
  * The rank must be less than the histogram's population.
+ *
+ * A snapshot remembers the answers to a few recent queries, so that
+ * repeated requests for the same ranks or quantiles (from different
+ * threads, say) are cheap.
  */
 uint64_t hg64s_value_at_rank(const hg64s *hs, uint64_t rank);
 
@@ -129,6 +431,242 @@ uint64_t hg64s_rank_of_value(const hg64s *hs, uint64_t value);
  */
 double hg64s_quantile_of_value(const hg64s *hs, uint64_t value);
 
+/*
+ * Get the count, sum, and mean of the values in a range of ranks,
+ * from `lo` inclusive to `hi` exclusive. For example, the mean of the
+ * slowest 1% is the range from 0.99 * population to the population.
+ * Values are taken to be at the midpoints of their buckets, like
+ * `hg64_mean_variance()`.
+ *
+ * If `pcount` is non-NULL it is set to the number of values.
+ * If `psum` is non-NULL it is set to the sum of the values.
+ * If `pmean` is non-NULL it is set to their mean, or zero if the
+ * range is empty.
+ *
+ * This takes O(log(64) + 2^sigbits) time: a binary search over the
+ * bins' cumulative totals, then a scan of the counters in the bins
+ * at each end of the range.
+ */
+void hg64s_rank_range(const hg64s *hs, uint64_t lo, uint64_t hi,
+		      uint64_t *pcount, double *psum, double *pmean);
+
+/*
+ * Like `hg64s_rank_range()` for the values between `lo` and `hi`,
+ * as determined by `hg64s_rank_of_value()`.
+ */
+void hg64s_value_range(const hg64s *hs, uint64_t lo, uint64_t hi,
+		       uint64_t *pcount, double *psum, double *pmean);
+
+/*
+ * Compare the distributions recorded in two non-empty snapshots,
+ * which can have different `sigbits` settings; the comparison
+ * is done at the lower precision.
+ *
+ * If `pks` is non-NULL it is set to the Kolmogorov-Smirnov distance,
+ * the largest difference between the cumulative distributions.
+ *
+ * If `pw1` is non-NULL it is set to the Wasserstein-1 (earth mover's)
+ * distance, measured in the same units as the values, which are taken
+ * to be at the midpoints of their buckets.
+ */
+void hg64s_distance(const hg64s *a, const hg64s *b,
+		    double *pks, double *pw1);
+
+/*
+ * Get a quantile difference profile: for each of the `n` quantiles,
+ * `diff[i]` is set to the value at `quantile[i]` in `b` minus the
+ * value at `quantile[i]` in `a`. Like `hg64s_distance()` the values
+ * are found at the lower precision of the two snapshots. This is
+ * quickest when the quantiles are in ascending order, which takes
+ * one pass over both snapshots. It does not use the rank memo.
+ */
+void hg64s_quantile_diff(const hg64s *a, const hg64s *b,
+			 const double *quantile, double *diff, size_t n);
+
+/*
+ * Export the non-zero buckets of a snapshot as columns, in three
+ * arrays which each have space for `size` elements. Returns the
+ * number of non-zero buckets; if the return value is greater than
+ * `size` the output has been truncated. Any of `min`, `max`, or
+ * `count` can be NULL if that column is not wanted. The columns are
+ * the same as `hg64_get()` returns for each bucket.
+ */
+size_t hg64s_columns(const hg64s *hs, uint64_t *min, uint64_t *max,
+		     uint64_t *count, size_t size);
+
+/*
+ * Export `n` snapshots concatenated into the same columns. The
+ * `offsets` array has space for `n + 1` elements, and is set so that
+ * the buckets from `hs[i]` are in the range `offsets[i]` inclusive to
+ * `offsets[i + 1]` exclusive, as in an Arrow large list array.
+ */
+size_t hg64s_columns_many(const hg64s *const *hs, size_t n, int64_t *offsets,
+			  uint64_t *min, uint64_t *max, uint64_t *count,
+			  size_t size);
+
+/*
+ * Downsample a snapshot to at most `k` buckets for visualization. The
+ * arrays `min`, `max`, and `count` must have space for `k` elements;
+ * the return value is the number of buckets filled in. Each output
+ * bucket is a group of adjacent histogram buckets, so the counts are
+ * exact.
+ *
+ * `hg64s_log_buckets()` spaces the buckets logarithmically between
+ * the smallest and largest values recorded.
+ *
+ * `hg64s_even_buckets()` makes buckets with approximately equal counts.
+ */
+size_t hg64s_log_buckets(const hg64s *hs, size_t k,
+			 uint64_t *min, uint64_t *max, uint64_t *count);
+size_t hg64s_even_buckets(const hg64s *hs, size_t k,
+			  uint64_t *min, uint64_t *max, uint64_t *count);
+
+/*
+ * Make a smaller copy of a snapshot for cold storage by merging runs
+ * of adjacent buckets, so that every rank query is within `eps` times
+ * the population of the original answer (i.e. quantiles are within
+ * `eps`). The achieved bound is returned in `*error` and the number
+ * of non-zero buckets in `*buckets`; either can be NULL. When you
+ * have finished with it, just free() it.
+ */
+hg64s *hg64s_compact(const hg64s *hs, double eps,
+		     double *error, size_t *buckets);
+
+/*
+ * Make a heatmap from a series of `n` snapshots, with `k` buckets
+ * logarithmically spaced between `lo` and `hi` on the other axis.
+ * Values outside that range are counted in the first or last bucket.
+ * The `matrix` has space for `n * k` counts; row `i` holds the counts
+ * for `hs[i]` in `matrix[i * k]` to `matrix[i * k + k - 1]`.
+ */
+void hg64s_heatmap(const hg64s *const *hs, size_t n,
+		   uint64_t lo, uint64_t hi, size_t k, uint64_t *matrix);
+
+/*
+ * Make a cumulative index of a snapshot's counters in `index`, which
+ * has space for `size` elements, for the batch queries below. Returns
+ * the number of elements required, which is one more than the number
+ * of counters; if that is greater than `size`, nothing is written.
+ * The index can be re-used for any number of queries.
+ */
+size_t hg64s_rank_index(const hg64s *hs, uint64_t *index, size_t size);
+
+/*
+ * Get the approximate ranks or quantiles of an array of `n` values,
+ * with the same results as calling `hg64s_rank_of_value()` or
+ * `hg64s_quantile_of_value()` for each one, but faster when there
+ * are many values. The values do not need to be sorted. The `index`
+ * from `hg64s_rank_index()` makes each query O(1); if it is NULL,
+ * each query scans its value's bin, as the single queries do. These
+ * functions do not allocate memory.
+ */
+void hg64s_rank_of_values(const hg64s *hs, const uint64_t *index,
+			  const uint64_t *value, uint64_t *rank, size_t n);
+void hg64s_quantile_of_values(const hg64s *hs, const uint64_t *index,
+			      const uint64_t *value, double *quantile,
+			      size_t n);
+
+/*
+ * Encode a snapshot in a compact archival format into `buffer`, which
+ * has `size` bytes available. Returns the number of bytes required;
+ * if the return value is greater than `size` the output has been
+ * truncated and is not usable.
+ *
+ * The counts are predicted from their neighbours and entropy coded,
+ * so smooth distributions compress well.
+ */
+size_t hg64s_encode(const hg64s *hs, uint8_t *buffer, size_t size);
+
+/*
+ * Decode a snapshot from the archival format. The result has exactly
+ * the same counts as the snapshot that was encoded. Returns NULL if
+ * the data is malformed. When you have finished with it, just free()
+ * it.
+ */
+hg64s *hg64s_decode(const uint8_t *buffer, size_t size);
+
+/*
+ * A series encoder compresses a sequence of snapshots of the same
+ * metric, taken at regular intervals. Each snapshot is stored as the
+ * changes since the previous one, with a keyframe in the archival
+ * format every `keyframe` snapshots. Returns NULL if `sigbits` is out
+ * of range or `keyframe` is zero.
+ *
+ * Counters that are idle or change at a steady rate cost nothing,
+ * and other changes cost about two bytes each. A one-off change
+ * costs twice, when it happens and when the rate returns to normal,
+ * and the snapshot after a keyframe lists every counter that is
+ * moving, so a series compresses less than the 10x to 50x that is
+ * typical for series of single numbers: in the test suite, a steady
+ * load plus 1% noise compresses about 8x with a keyframe every 30
+ * snapshots. Longer keyframe intervals compress better.
+ */
+hg64series *hg64series_create(unsigned sigbits, unsigned keyframe);
+
+/*
+ * Free a series encoder and its data.
+ */
+void hg64series_destroy(hg64series *ts);
+
+/*
+ * Add a snapshot to the end of a series. Returns -1 if the snapshot's
+ * `sigbits` is different from the series.
+ */
+int hg64series_append(hg64series *ts, const hg64s *hs);
+
+/*
+ * Get the encoded series, which remains valid until the next append.
+ */
+const uint8_t *hg64series_data(const hg64series *ts, size_t *size);
+
+/*
+ * Count the snapshots in an encoded series.
+ */
+size_t hg64series_count(const uint8_t *buffer, size_t size);
+
+/*
+ * Decode snapshot number `i` from an encoded series. Decoding starts
+ * from the nearest keyframe, so it is quicker with more keyframes.
+ * Returns NULL if the data is malformed or there is no such snapshot.
+ * When you have finished with it, just free() it.
+ */
+hg64s *hg64series_point(const uint8_t *buffer, size_t size, size_t i);
+
+/*
+ * Add up snapshots `from` inclusive to `to` exclusive from an encoded
+ * series, which is faster than decoding them one by one.
+ */
+hg64s *hg64series_sum(const uint8_t *buffer, size_t size,
+		      size_t from, size_t to);
+
+/*
+ * Write a snapshot into `buffer` as an OpenTelemetry (OTLP)
+ * `ExponentialHistogramDataPoint` protobuf message, with the given
+ * start and end times in nanoseconds since the Unix epoch. Returns
+ * the number of bytes required; if the return value is greater than
+ * `size` the output has been truncated. The caller adds attributes
+ * and wraps the data point in its metric.
+ *
+ * The scale is `sigbits - 1`. Buckets are linear within each octave
+ * rather than exponential, so each one is moved whole into the
+ * exponential bucket containing its centre, which can shift ranks by
+ * up to one of our buckets.
+ */
+size_t hg64s_otlp(const hg64s *hs, uint64_t start, uint64_t time,
+		  uint8_t *buffer, size_t size);
+
+/*
+ * The kernels used by `hg64_add_array()`, `hg64s_merge()`, and when
+ * summarizing snapshots, are chosen at run time from the variants
+ * "avx512", "avx2", "lzcnt", and "scalar", whichever is the first
+ * that the CPU supports, unless the `HG64_KERNEL` environment
+ * variable names another. This function forces the named variant,
+ * or with NULL returns the current one. Returns the name of the
+ * kernel in use, or NULL if the named variant is unknown or is not
+ * supported, in which case the kernel is not changed.
+ */
+const char *hg64_kernel(const char *name);
+
 /* TODO */
 
 /*
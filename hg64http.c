@@ -0,0 +1,497 @@
+/*
+ * hg64http - serve histograms over HTTP for Prometheus
+ *
+ * Written by Tony Finch <dot@dotat.at> <fanf@isc.org>
+ *
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * SPDX-License-Identifier: MPL-2.0
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hg64.h"
+#include "hg64http.h"
+
+/* longest request header we will read */
+#define REQUEST 4096
+
+/* connections served at once, and how long each one may take */
+#define CLIENTS 64
+#define CLIENT_MS 5000
+
+/*
+ * growable text buffer
+ */
+struct text {
+	char *buf;
+	size_t len, cap;
+};
+
+/*
+ * A registered histogram and its cached rendering, which is valid
+ * while the histogram's raw population and generation are unchanged.
+ */
+struct metric {
+	char *name;
+	char *help;
+	hg64 *hg;
+	struct text text;
+	uint64_t population;
+	uint64_t generation;
+	bool rendered;
+};
+
+/*
+ * A connection reads its request, then sends its response, which
+ * is built in one go when the request is complete.
+ */
+struct client {
+	int fd;
+	uint64_t deadline;
+	size_t len, sent;
+	struct text out;
+	char req[REQUEST + 1];
+};
+
+struct hg64http {
+	int fd;
+	int wake[2];
+	unsigned port;
+	pthread_t tid;
+	pthread_mutex_t lock;
+	struct metric *metric;
+	size_t count, cap;
+	uint64_t renders;
+};
+
+/**********************************************************************/
+
+static void
+append(struct text *t, const char *fmt, ...) {
+	if(t->buf == NULL) {
+		t->cap = 256;
+		t->buf = malloc(t->cap);
+	}
+	for(;;) {
+		va_list ap;
+		va_start(ap, fmt);
+		int n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+		va_end(ap);
+		if(n >= 0 && (size_t)n < t->cap - t->len) {
+			t->len += (size_t)n;
+			return;
+		}
+		t->cap = t->cap * 2 + (size_t)(n < 0 ? 0 : n) + 1;
+		t->buf = realloc(t->buf, t->cap);
+	}
+}
+
+/*
+ * Every non-zero bucket becomes a Prometheus bucket whose upper bound
+ * is the largest value in the bucket, so no counts are estimated.
+ */
+static void
+render(struct metric *m) {
+	hg64s *hs = hg64_snapshot(m->hg);
+	size_t n = hg64s_columns(hs, NULL, NULL, NULL, 0);
+	uint64_t *max = malloc(sizeof(uint64_t) * (n * 2 + 1));
+	uint64_t *count = max + n;
+	hg64s_columns(hs, NULL, max, count, n);
+	uint64_t pop = 0;
+	double sum = 0.0;
+	hg64s_rank_range(hs, 0, UINT64_MAX, &pop, &sum, NULL);
+
+	struct text *t = &m->text;
+	t->len = 0;
+	append(t, "# HELP %s %s\n", m->name, m->help);
+	append(t, "# TYPE %s histogram\n", m->name);
+	uint64_t cum = 0;
+	for(size_t i = 0; i < n; i++) {
+		cum += count[i];
+		append(t, "%s_bucket{le=\"%llu\"} %llu\n", m->name,
+		       (unsigned long long)max[i], (unsigned long long)cum);
+	}
+	append(t, "%s_bucket{le=\"+Inf\"} %llu\n", m->name,
+	       (unsigned long long)pop);
+	append(t, "%s_sum %.17g\n", m->name, sum);
+	append(t, "%s_count %llu\n", m->name, (unsigned long long)pop);
+	free(max);
+	free(hs);
+}
+
+/**********************************************************************/
+
+static void
+respond(struct text *out, const char *status, const char *body) {
+	append(out,
+	       "HTTP/1.1 %s\r\n"
+	       "Content-Type: text/plain; charset=utf-8\r\n"
+	       "Content-Length: %zu\r\n"
+	       "Connection: close\r\n"
+	       "\r\n%s", status, strlen(body), body);
+}
+
+/*
+ * Bring stale renderings up to date and copy them into the response,
+ * which is sent after unlocking, so a slow client does not hold up
+ * other scrapes or registrations. The change signals are read before
+ * rendering, so a change during rendering is seen next time.
+ *
+ * The histogram text is the same in both formats; OpenMetrics adds
+ * an end marker.
+ */
+static void
+scrape(hg64http *srv, struct text *out, bool head, bool openmetrics) {
+	const char *eof = openmetrics ? "# EOF\n" : "";
+	pthread_mutex_lock(&srv->lock);
+	size_t total = strlen(eof);
+	for(size_t i = 0; i < srv->count; i++) {
+		struct metric *m = &srv->metric[i];
+		uint64_t generation = hg64_generation(m->hg);
+		uint64_t population = hg64_raw_population(m->hg);
+		if(!m->rendered || m->generation != generation ||
+		   m->population != population) {
+			render(m);
+			m->generation = generation;
+			m->population = population;
+			m->rendered = true;
+			srv->renders++;
+		}
+		total += m->text.len;
+	}
+	append(out,
+	       "HTTP/1.1 200 OK\r\n"
+	       "Content-Type: %s\r\n"
+	       "Content-Length: %zu\r\n"
+	       "Connection: close\r\n"
+	       "\r\n",
+	       openmetrics
+		       ? "application/openmetrics-text; version=1.0.0; "
+			 "charset=utf-8"
+		       : "text/plain; version=0.0.4; charset=utf-8",
+	       total);
+	for(size_t i = 0; !head && i < srv->count; i++) {
+		struct text *t = &srv->metric[i].text;
+		append(out, "%.*s", (int)t->len, t->buf);
+	}
+	pthread_mutex_unlock(&srv->lock);
+	append(out, "%s", head ? "" : eof);
+}
+
+/*
+ * does an Accept header in the request ask for OpenMetrics?
+ */
+static bool
+accepts_openmetrics(const char *req) {
+	const char *line = strstr(req, "\r\n");
+	while(line != NULL && strncmp(line, "\r\n\r\n", 4) != 0) {
+		line += 2;
+		const char *end = strstr(line, "\r\n");
+		size_t len = end == NULL ? strlen(line) : (size_t)(end - line);
+		const char *type = "application/openmetrics-text";
+		if(strncasecmp(line, "Accept:", 7) == 0) {
+			for(size_t i = 7; i + strlen(type) <= len; i++) {
+				if(strncasecmp(line + i, type,
+					       strlen(type)) == 0) {
+					return(true);
+				}
+			}
+		}
+		line = end;
+	}
+	return(false);
+}
+
+static void
+serve(hg64http *srv, struct client *c) {
+	const char *req = c->req;
+	bool get = strncmp(req, "GET ", 4) == 0;
+	bool head = strncmp(req, "HEAD ", 5) == 0;
+	if(!get && !head) {
+		respond(&c->out, "405 Method Not Allowed",
+			"method not allowed\n");
+		return;
+	}
+	const char *path = req + (get ? 4 : 5);
+	size_t plen = strcspn(path, " ?");
+	if(plen != strlen("/metrics") || strncmp(path, "/metrics", plen)) {
+		respond(&c->out, "404 Not Found", "not found\n");
+		return;
+	}
+	scrape(srv, &c->out, head, accepts_openmetrics(req));
+}
+
+static bool
+would_block(void) {
+	return(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * Make progress on a connection when its socket is ready. Returns
+ * false when the connection is finished or has failed.
+ */
+static bool
+client_io(hg64http *srv, struct client *c) {
+	if(c->out.buf == NULL) {
+		ssize_t n = recv(c->fd, c->req + c->len, REQUEST - c->len, 0);
+		if(n < 0) {
+			return(would_block());
+		}
+		if(n == 0) {
+			return(false);
+		}
+		c->len += (size_t)n;
+		c->req[c->len] = '\0';
+		if(c->len < REQUEST && strstr(c->req, "\r\n\r\n") == NULL) {
+			return(true);
+		}
+		serve(srv, c);
+	}
+	while(c->sent < c->out.len) {
+		ssize_t n = send(c->fd, c->out.buf + c->sent,
+				 c->out.len - c->sent, MSG_NOSIGNAL);
+		if(n < 0) {
+			return(would_block());
+		}
+		c->sent += (size_t)n;
+	}
+	return(false);
+}
+
+static uint64_t
+now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000);
+}
+
+/*
+ * All the sockets are non-blocking, and connections are multiplexed
+ * with poll(), so a slow client does not hold up the others. Each
+ * connection is closed when it is done or its time is up; when all
+ * the client slots are busy, new connections wait in the backlog.
+ */
+static void *
+server(void *arg) {
+	hg64http *srv = arg;
+	struct client *client = calloc(CLIENTS, sizeof(*client));
+	struct pollfd pfd[2 + CLIENTS];
+	size_t clients = 0;
+	for(;;) {
+		uint64_t now = now_ms();
+		int timeout = -1;
+		pfd[0] = (struct pollfd){ .fd = srv->wake[0], .events = POLLIN };
+		pfd[1] = (struct pollfd){
+			.fd = srv->fd,
+			.events = clients < CLIENTS ? POLLIN : 0,
+		};
+		for(size_t i = 0; i < clients; i++) {
+			struct client *c = &client[i];
+			pfd[2 + i] = (struct pollfd){
+				.fd = c->fd,
+				.events = c->out.buf == NULL ? POLLIN : POLLOUT,
+			};
+			int ms = c->deadline > now ? (int)(c->deadline - now)
+						   : 0;
+			timeout = timeout < 0 || ms < timeout ? ms : timeout;
+		}
+		if(poll(pfd, 2 + clients, timeout) < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if(pfd[0].revents != 0) {
+			break;
+		}
+		now = now_ms();
+		/* backwards, so finished clients can be replaced by the last */
+		for(size_t i = clients; i-- > 0;) {
+			struct client *c = &client[i];
+			bool live = now < c->deadline;
+			if(live && pfd[2 + i].revents != 0) {
+				live = client_io(srv, c);
+			}
+			if(!live) {
+				close(c->fd);
+				free(c->out.buf);
+				*c = client[--clients];
+			}
+		}
+		while(clients < CLIENTS && (pfd[1].revents & POLLIN)) {
+			int fd = accept(srv->fd, NULL, NULL);
+			if(fd < 0) {
+				break;
+			}
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			struct client *c = &client[clients++];
+			*c = (struct client){
+				.fd = fd,
+				.deadline = now + CLIENT_MS,
+			};
+		}
+	}
+	for(size_t i = 0; i < clients; i++) {
+		close(client[i].fd);
+		free(client[i].out.buf);
+	}
+	free(client);
+	return(NULL);
+}
+
+/**********************************************************************/
+
+hg64http *
+hg64http_create(unsigned port) {
+	if(port > 65535) {
+		errno = EINVAL;
+		return(NULL);
+	}
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0) {
+		return(NULL);
+	}
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_port = htons((uint16_t)port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t slen = sizeof(sin);
+	hg64http *srv = calloc(1, sizeof(*srv));
+	srv->fd = fd;
+	if(bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	   listen(fd, 16) < 0 ||
+	   getsockname(fd, (struct sockaddr *)&sin, &slen) < 0 ||
+	   pipe(srv->wake) < 0) {
+		int err = errno;
+		close(fd);
+		free(srv);
+		errno = err;
+		return(NULL);
+	}
+	srv->port = ntohs(sin.sin_port);
+	pthread_mutex_init(&srv->lock, NULL);
+	int err = pthread_create(&srv->tid, NULL, server, srv);
+	if(err != 0) {
+		pthread_mutex_destroy(&srv->lock);
+		close(srv->wake[0]);
+		close(srv->wake[1]);
+		close(fd);
+		free(srv);
+		errno = err;
+		return(NULL);
+	}
+	return(srv);
+}
+
+void
+hg64http_destroy(hg64http *srv) {
+	while(write(srv->wake[1], "", 1) < 0 && errno == EINTR) {
+	}
+	pthread_join(srv->tid, NULL);
+	close(srv->wake[0]);
+	close(srv->wake[1]);
+	close(srv->fd);
+	for(size_t i = 0; i < srv->count; i++) {
+		free(srv->metric[i].name);
+		free(srv->metric[i].help);
+		free(srv->metric[i].text.buf);
+	}
+	free(srv->metric);
+	pthread_mutex_destroy(&srv->lock);
+	free(srv);
+}
+
+unsigned
+hg64http_port(hg64http *srv) {
+	return(srv->port);
+}
+
+/*
+ * metric names match [a-zA-Z_:][a-zA-Z0-9_:]*
+ */
+static bool
+valid_name(const char *name) {
+	for(size_t i = 0; name[i] != '\0'; i++) {
+		char c = name[i];
+		bool alpha = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+			     c == '_' || c == ':';
+		bool digit = c >= '0' && c <= '9';
+		if(!alpha && !(digit && i > 0)) {
+			return(false);
+		}
+	}
+	return(name[0] != '\0');
+}
+
+/*
+ * help text escapes backslashes and newlines
+ */
+static char *
+escape_help(const char *help) {
+	struct text t = { 0 };
+	append(&t, "");
+	for(; *help != '\0'; help++) {
+		if(*help == '\\') {
+			append(&t, "\\\\");
+		} else if(*help == '\n') {
+			append(&t, "\\n");
+		} else {
+			append(&t, "%c", *help);
+		}
+	}
+	return(t.buf);
+}
+
+int
+hg64http_register(hg64http *srv, const char *name, const char *help,
+		  hg64 *hg) {
+	if(!valid_name(name)) {
+		return(-1);
+	}
+	struct metric m = {
+		.name = strdup(name),
+		.help = escape_help(help),
+		.hg = hg,
+	};
+	pthread_mutex_lock(&srv->lock);
+	if(srv->count == srv->cap) {
+		srv->cap = srv->cap * 2 + 4;
+		srv->metric = realloc(srv->metric,
+				      sizeof(*srv->metric) * srv->cap);
+	}
+	srv->metric[srv->count++] = m;
+	pthread_mutex_unlock(&srv->lock);
+	return(0);
+}
+
+uint64_t
+hg64http_renders(hg64http *srv) {
+	pthread_mutex_lock(&srv->lock);
+	uint64_t renders = srv->renders;
+	pthread_mutex_unlock(&srv->lock);
+	return(renders);
+}
@@ -0,0 +1,58 @@
+/*
+ * hg64http - serve histograms over HTTP for Prometheus
+ *
+ * Written by Tony Finch <dot@dotat.at> <fanf@isc.org>
+ *
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * SPDX-License-Identifier: MPL-2.0
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+typedef struct hg64http hg64http;
+
+/*
+ * Start an HTTP/1.1 server in its own thread, listening on the
+ * loopback address at `port`, or an ephemeral port if `port` is zero.
+ * It serves the registered histograms at `/metrics` in Prometheus
+ * text format, or in OpenMetrics format if the request's `Accept`
+ * header mentions `application/openmetrics-text`. Up to 64 clients
+ * are served at once, and each connection is closed after 5 seconds.
+ * Returns NULL if the socket or thread could not be set up, with
+ * `errno` set.
+ */
+hg64http *hg64http_create(unsigned port);
+
+/*
+ * Stop the server and free it. The histograms are not destroyed.
+ */
+void hg64http_destroy(hg64http *srv);
+
+/*
+ * Get the port number the server is listening on.
+ */
+unsigned hg64http_port(hg64http *srv);
+
+/*
+ * Add a histogram to the server's registry. The `name` must be a
+ * valid Prometheus metric name, and `help` is a line of text. Both
+ * are copied. The histogram must stay alive until the server is
+ * destroyed. Returns -1 if the name is invalid.
+ *
+ * Each histogram's rendered text is cached until its
+ * `hg64_raw_population()` or `hg64_generation()` changes, so a scrape only costs a snapshot for
+ * histograms that have been updated, however many scrapers there are.
+ * Histograms created with `hg64_create_totals()` make the change
+ * check O(1).
+ */
+int hg64http_register(hg64http *srv, const char *name, const char *help,
+		      hg64 *hg);
+
+/*
+ * Count how many times histograms have been rendered, to monitor
+ * the effectiveness of the cache.
+ */
+uint64_t hg64http_renders(hg64http *srv);
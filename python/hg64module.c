@@ -0,0 +1,332 @@
+/*
+ * hg64module - Python bindings for hg64
+ *
+ * Written by Tony Finch <dot@dotat.at> <fanf@isc.org>
+ *
+ * Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+ *
+ * SPDX-License-Identifier: MPL-2.0
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hg64.h"
+
+/* values converted per call to hg64_add_array() */
+#define BLOCK 1024
+
+typedef struct {
+	PyObject_HEAD
+	hg64 *hg;
+} Histogram;
+
+/*
+ * Arrays are ingested by element type; only 8 byte elements
+ * are accepted, which covers NumPy uint64, int64, and float64.
+ */
+enum kind { UNSIGNED, SIGNED, FLOAT };
+
+static int
+buffer_kind(Py_buffer *view) {
+	const char *fmt = view->format == NULL ? "B" : view->format;
+	if(*fmt == '@' || *fmt == '=' ||
+	   (*fmt == '<' && PY_LITTLE_ENDIAN) ||
+	   (*fmt == '>' && PY_BIG_ENDIAN)) {
+		fmt++;
+	}
+	if(view->itemsize == 8 && fmt[0] != '\0' && fmt[1] == '\0') {
+		switch(fmt[0]) {
+		case 'L': case 'Q': case 'N':
+			return(UNSIGNED);
+		case 'l': case 'q': case 'n':
+			return(SIGNED);
+		case 'd':
+			return(FLOAT);
+		}
+	}
+	PyErr_Format(PyExc_TypeError,
+		     "expected an array of uint64, int64, or float64, "
+		     "not format '%s'", view->format);
+	return(-1);
+}
+
+/*
+ * the index of the first value that is not a valid uint64, or n
+ */
+static size_t
+find_invalid(enum kind kind, const void *buf, size_t n) {
+	const int64_t *sv = buf;
+	const double *dv = buf;
+	for(size_t i = 0; i < n; i++) {
+		bool ok = kind == SIGNED ? sv[i] >= 0 :
+			kind == FLOAT ? dv[i] >= 0.0 && dv[i] < 0x1p64 :
+			true;
+		if(!ok) {
+			return(i);
+		}
+	}
+	return(n);
+}
+
+/*
+ * Convert blocks of values to uint64 (floats are truncated)
+ * and feed them to the batch ingest path.
+ */
+static void
+add_values(hg64 *hg, enum kind kind, const void *buf, size_t n) {
+	if(kind == UNSIGNED) {
+		hg64_add_array(hg, buf, n);
+		return;
+	}
+	const int64_t *sv = buf;
+	const double *dv = buf;
+	uint64_t block[BLOCK];
+	for(size_t i = 0; i < n; i += BLOCK) {
+		size_t len = n - i < BLOCK ? n - i : BLOCK;
+		for(size_t j = 0; j < len; j++) {
+			block[j] = kind == SIGNED ? (uint64_t)sv[i + j]
+				: (uint64_t)dv[i + j];
+		}
+		hg64_add_array(hg, block, len);
+	}
+}
+
+/**********************************************************************/
+
+static PyObject *
+Histogram_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = { "sigbits", NULL };
+	unsigned sigbits = 5;
+	if(!PyArg_ParseTupleAndKeywords(args, kwds, "|I", kwlist, &sigbits)) {
+		return(NULL);
+	}
+	hg64 *hg = hg64_create(sigbits);
+	if(hg == NULL) {
+		PyErr_SetString(PyExc_ValueError,
+				"sigbits must be between 1 and 15");
+		return(NULL);
+	}
+	Histogram *self = (Histogram *)type->tp_alloc(type, 0);
+	if(self == NULL) {
+		hg64_destroy(hg);
+		return(NULL);
+	}
+	self->hg = hg;
+	return((PyObject *)self);
+}
+
+static void
+Histogram_dealloc(Histogram *self) {
+	hg64_destroy(self->hg);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *
+Histogram_add(Histogram *self, PyObject *arg) {
+	Py_buffer view;
+	if(PyObject_GetBuffer(arg, &view,
+			      PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+		return(NULL);
+	}
+	int kind = buffer_kind(&view);
+	if(kind < 0) {
+		PyBuffer_Release(&view);
+		return(NULL);
+	}
+	size_t n = (size_t)(view.len / view.itemsize);
+	size_t bad = n;
+	Py_BEGIN_ALLOW_THREADS
+	if(kind != UNSIGNED) {
+		bad = find_invalid(kind, view.buf, n);
+	}
+	if(bad == n) {
+		add_values(self->hg, kind, view.buf, n);
+	}
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&view);
+	if(bad < n) {
+		PyErr_Format(PyExc_ValueError,
+			     "value at index %zu is not a valid uint64", bad);
+		return(NULL);
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+Histogram_inc(Histogram *self, PyObject *arg) {
+	unsigned long long value = PyLong_AsUnsignedLongLong(arg);
+	if(value == (unsigned long long)-1 && PyErr_Occurred()) {
+		return(NULL);
+	}
+	hg64_inc(self->hg, value);
+	Py_RETURN_NONE;
+}
+
+/*
+ * NumPy is optional; without it the columns are memoryviews
+ */
+static PyObject *
+to_array(PyObject *bytes) {
+	PyObject *numpy = PyImport_ImportModule("numpy");
+	if(numpy != NULL) {
+		PyObject *array = PyObject_CallMethod(numpy, "frombuffer",
+						      "Os", bytes, "uint64");
+		Py_DECREF(numpy);
+		return(array);
+	}
+	if(!PyErr_ExceptionMatches(PyExc_ImportError)) {
+		return(NULL);
+	}
+	PyErr_Clear();
+	PyObject *view = PyMemoryView_FromObject(bytes);
+	if(view == NULL) {
+		return(NULL);
+	}
+	PyObject *cast = PyObject_CallMethod(view, "cast", "s", "Q");
+	Py_DECREF(view);
+	return(cast);
+}
+
+/*
+ * A snapshot is exported straight into three bytearrays, which
+ * become the arrays without copying.
+ */
+static PyObject *
+Histogram_columns(Histogram *self, PyObject *Py_UNUSED(ignored)) {
+	hg64s *hs;
+	size_t n;
+	Py_BEGIN_ALLOW_THREADS
+	hs = hg64_snapshot(self->hg);
+	n = hg64s_columns(hs, NULL, NULL, NULL, 0);
+	Py_END_ALLOW_THREADS
+	PyObject *col[3] = { NULL, NULL, NULL };
+	PyObject *result = NULL;
+	for(unsigned i = 0; i < 3; i++) {
+		col[i] = PyByteArray_FromStringAndSize(NULL,
+				(Py_ssize_t)(n * sizeof(uint64_t)));
+		if(col[i] == NULL) {
+			goto done;
+		}
+	}
+	uint64_t *min = (uint64_t *)PyByteArray_AS_STRING(col[0]);
+	uint64_t *max = (uint64_t *)PyByteArray_AS_STRING(col[1]);
+	uint64_t *count = (uint64_t *)PyByteArray_AS_STRING(col[2]);
+	Py_BEGIN_ALLOW_THREADS
+	hg64s_columns(hs, min, max, count, n);
+	Py_END_ALLOW_THREADS
+	for(unsigned i = 0; i < 3; i++) {
+		PyObject *array = to_array(col[i]);
+		if(array == NULL) {
+			goto done;
+		}
+		Py_SETREF(col[i], array);
+	}
+	result = PyTuple_Pack(3, col[0], col[1], col[2]);
+done:
+	for(unsigned i = 0; i < 3; i++) {
+		Py_XDECREF(col[i]);
+	}
+	free(hs);
+	return(result);
+}
+
+static PyObject *
+Histogram_value_at_quantile(Histogram *self, PyObject *arg) {
+	double quantile = PyFloat_AsDouble(arg);
+	if(quantile == -1.0 && PyErr_Occurred()) {
+		return(NULL);
+	}
+	if(!(quantile >= 0.0 && quantile < 1.0)) {
+		PyErr_SetString(PyExc_ValueError,
+				"quantile must be >= 0.0 and < 1.0");
+		return(NULL);
+	}
+	uint64_t value;
+	Py_BEGIN_ALLOW_THREADS
+	hg64s *hs = hg64_snapshot(self->hg);
+	value = hg64s_value_at_quantile(hs, quantile);
+	free(hs);
+	Py_END_ALLOW_THREADS
+	return(PyLong_FromUnsignedLongLong(value));
+}
+
+static PyObject *
+Histogram_population(Histogram *self, void *Py_UNUSED(closure)) {
+	return(PyLong_FromUnsignedLongLong(hg64_population(self->hg)));
+}
+
+static PyMethodDef Histogram_methods[] = {
+	{ "add", (PyCFunction)Histogram_add, METH_O,
+	  "add(values)\n--\n\n"
+	  "Add 1 to the counter of each value in a C-contiguous array\n"
+	  "of uint64, int64, or float64. Floats are truncated. Raises\n"
+	  "ValueError without adding anything if any value is negative\n"
+	  "or out of range. The GIL is released while adding." },
+	{ "inc", (PyCFunction)Histogram_inc, METH_O,
+	  "inc(value)\n--\n\n"
+	  "Add 1 to the value's counter." },
+	{ "columns", (PyCFunction)Histogram_columns, METH_NOARGS,
+	  "columns()\n--\n\n"
+	  "Take a snapshot and return its non-zero buckets as a tuple of\n"
+	  "uint64 arrays (min, max, count). The arrays are NumPy arrays\n"
+	  "if NumPy is installed, otherwise memoryviews." },
+	{ "value_at_quantile", (PyCFunction)Histogram_value_at_quantile,
+	  METH_O,
+	  "value_at_quantile(quantile)\n--\n\n"
+	  "Get the approximate value at a quantile >= 0.0 and < 1.0." },
+	{ NULL },
+};
+
+static PyGetSetDef Histogram_getset[] = {
+	{ "population", (getter)Histogram_population, NULL,
+	  "number of values recorded", NULL },
+	{ NULL },
+};
+
+static PyTypeObject HistogramType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "hg64.Histogram",
+	.tp_doc = PyDoc_STR("Histogram(sigbits=5)\n--\n\n"
+			    "A 64-bit log-linear histogram."),
+	.tp_basicsize = sizeof(Histogram),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = Histogram_new,
+	.tp_dealloc = (destructor)Histogram_dealloc,
+	.tp_methods = Histogram_methods,
+	.tp_getset = Histogram_getset,
+};
+
+static PyModuleDef hg64module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "hg64",
+	.m_doc = "A 64-bit histogram / quantile sketch.",
+	.m_size = -1,
+};
+
+PyMODINIT_FUNC
+PyInit_hg64(void) {
+	if(PyType_Ready(&HistogramType) < 0) {
+		return(NULL);
+	}
+	PyObject *m = PyModule_Create(&hg64module);
+	if(m == NULL) {
+		return(NULL);
+	}
+	Py_INCREF(&HistogramType);
+	if(PyModule_AddObject(m, "Histogram",
+			      (PyObject *)&HistogramType) < 0) {
+		Py_DECREF(&HistogramType);
+		Py_DECREF(m);
+		return(NULL);
+	}
+	return(m);
+}
@@ -0,0 +1,30 @@
+# Build the hg64 Python extension:
+#
+#	python3 setup.py build_ext --inplace
+#
+# Written by Tony Finch <dot@dotat.at> <fanf@isc.org>
+#
+# Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+#
+# SPDX-License-Identifier: MPL-2.0
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0.  If a copy of the MPL was not distributed with this
+# file, you can obtain one at https://mozilla.org/MPL/2.0/.
+
+from setuptools import Extension, setup
+
+setup(
+    name="hg64",
+    version="0.1",
+    description="A 64-bit histogram / quantile sketch",
+    license="MPL-2.0",
+    ext_modules=[
+        Extension(
+            "hg64",
+            sources=["hg64module.c", "../hg64.c"],
+            include_dirs=[".."],
+            extra_compile_args=["-std=gnu11", "-O2"],
+        )
+    ],
+)
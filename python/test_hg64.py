@@ -0,0 +1,100 @@
+# Tests for the hg64 Python extension; build it in place first.
+#
+# Written by Tony Finch <dot@dotat.at> <fanf@isc.org>
+#
+# Copyright (C) Internet Systems Consortium, Inc. ("ISC")
+#
+# SPDX-License-Identifier: MPL-2.0
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0.  If a copy of the MPL was not distributed with this
+# file, you can obtain one at https://mozilla.org/MPL/2.0/.
+
+import array
+import random
+import time
+import unittest
+
+import hg64
+
+
+class TestHistogram(unittest.TestCase):
+    def setUp(self):
+        rng = random.Random(64)
+        self.values = [rng.getrandbits(rng.randrange(1, 65))
+                       for _ in range(100000)]
+        self.values += [0, 1, 2**63, 2**64 - 1]
+
+    def reference(self):
+        hg = hg64.Histogram()
+        for v in self.values:
+            hg.inc(v)
+        return hg
+
+    def test_batch_matches_inc(self):
+        hg = hg64.Histogram()
+        hg.add(array.array("Q", self.values))
+        ref = self.reference()
+        self.assertEqual(hg.population, len(self.values))
+        self.assertEqual([list(c) for c in hg.columns()],
+                         [list(c) for c in ref.columns()])
+
+    def test_signed_and_float(self):
+        small = [v >> 12 for v in self.values]
+        hq = hg64.Histogram()
+        hd = hg64.Histogram()
+        hq.add(array.array("q", small))
+        hd.add(array.array("d", [v + 0.5 for v in small]))
+        self.assertEqual([list(c) for c in hq.columns()],
+                         [list(c) for c in hd.columns()])
+
+    def test_columns(self):
+        hg = hg64.Histogram(sigbits=3)
+        hg.add(array.array("Q", self.values))
+        lo, hi, count = hg.columns()
+        self.assertEqual(sum(count), hg.population)
+        self.assertTrue(all(a <= b for a, b in zip(lo, hi)))
+        self.assertTrue(all(b < a for a, b in zip(lo[1:], hi)))
+
+    def test_invalid(self):
+        hg = hg64.Histogram()
+        with self.assertRaises(ValueError):
+            hg.add(array.array("q", [1, 2, -3]))
+        with self.assertRaises(ValueError):
+            hg.add(array.array("d", [1.0, float("nan")]))
+        with self.assertRaises(ValueError):
+            hg.add(array.array("d", [2.0**64]))
+        self.assertEqual(hg.population, 0)
+        with self.assertRaises(TypeError):
+            hg.add(array.array("i", [1, 2, 3]))
+        with self.assertRaises(TypeError):
+            hg.add([1, 2, 3])
+        with self.assertRaises(ValueError):
+            hg64.Histogram(sigbits=16)
+        with self.assertRaises(ValueError):
+            hg.value_at_quantile(1.0)
+
+    def test_quantile(self):
+        hg = hg64.Histogram()
+        hg.add(array.array("Q", range(1, 1001)))
+        self.assertAlmostEqual(hg.value_at_quantile(0.5), 500, delta=10)
+
+    def test_speed(self):
+        values = array.array("Q", self.values * 10)
+        hg = hg64.Histogram()
+        t0 = time.perf_counter()
+        for v in values:
+            hg.inc(v)
+        t1 = time.perf_counter()
+        hg.add(values)
+        t2 = time.perf_counter()
+        hg.columns()
+        t3 = time.perf_counter()
+        n = len(values)
+        print(f"\ninc {(t1 - t0) / n * 1e9:.1f} ns/value, "
+              f"add {(t2 - t1) / n * 1e9:.1f} ns/value, "
+              f"columns {(t3 - t2) * 1e6:.0f} us")
+
+
+if __name__ == "__main__":
+    unittest.main()
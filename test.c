@@ -10,18 +10,26 @@
  * file, you can obtain one at https://mozilla.org/MPL/2.0/.
  */
 
+#include <arpa/inet.h>
 #include <assert.h>
 #include <err.h>
 #include <inttypes.h>
 #include <math.h>
+#include <netinet/in.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "hg64.h"
+#include "hg64http.h"
 #include "random.h"
 
 extern void hg64_validate(void);
@@ -184,6 +192,1319 @@ data_vs_hg64(hg64s *hs, double q) {
 	       (q - p) / (q == 0.0 ? 1.0 : q));
 }
 
+static void
+totals(hg64 *hg, hg64s *hs) {
+	hg64 *thg = hg64_create_totals(hg64_sigbits(hg));
+	hg64_merge(thg, hg);
+	assert(hg64_population(thg) == hg64_population(hg));
+	for(double q = 0.0; q < 1.0; q += 0.0625) {
+		uint64_t value = hg64s_value_at_quantile(hs, q);
+		assert(hg64_value_at_quantile(hg, q) == value);
+		assert(hg64_value_at_quantile(thg, q) == value);
+		uint64_t rank = hg64s_rank_of_value(hs, value);
+		assert(hg64_rank_of_value(hg, value) == rank);
+		assert(hg64_rank_of_value(thg, value) == rank);
+	}
+	uint64_t t0 = nanotime();
+	for(double q = 0.0; q < 1.0; q += 0.0009765625) {
+		hg64_value_at_quantile(thg, q);
+	}
+	uint64_t t1 = nanotime();
+	printf("totals %.0f ns per quantile\n", (double)(t1 - t0) / 1024);
+	hg64_destroy(thg);
+}
+
+static void
+thresholds(hg64 *hg, hg64s *hs) {
+	hg64 *thg = hg64_create_totals(hg64_sigbits(hg));
+	/* one registered before and one after loading the data */
+	assert(hg64_threshold(thg, RANGE / 10 * 9) == 0);
+	hg64_merge(thg, hg);
+	assert(hg64_threshold(thg, RANGE / 2) == 1);
+	for(unsigned i = 0; i < 2; i++) {
+		uint64_t value = hg64_threshold_value(thg, i) + 1;
+		uint64_t over = hg64s_rank_of_value(hs, UINT64_MAX)
+			      - hg64s_rank_of_value(hs, value);
+		printf("threshold %"PRIu64" ratio %f\n",
+		       value, hg64_threshold_ratio(thg, i));
+		assert(hg64_threshold_count(thg, i) == over);
+	}
+	hg64_destroy(thg);
+}
+
+static void
+batch_ranks(hg64s *hs) {
+	static uint64_t rank[SAMPLES];
+	static double quantile[SAMPLES];
+	uint64_t *value = data[THREADS - 1];
+	size_t size = hg64s_rank_index(hs, NULL, 0);
+	uint64_t *index = malloc(sizeof(uint64_t) * size);
+	assert(hg64s_rank_index(hs, index, size - 1) == size);
+	assert(hg64s_rank_index(hs, index, size) == size);
+	hg64s_rank_of_values(hs, index, value, rank, SAMPLES);
+	hg64s_quantile_of_values(hs, index, value, quantile, SAMPLES);
+	uint64_t t0 = nanotime();
+	hg64s_rank_of_values(hs, index, value, rank, SAMPLES);
+	uint64_t t1 = nanotime();
+	hg64s_quantile_of_values(hs, index, value, quantile, SAMPLES);
+	uint64_t t2 = nanotime();
+	for(size_t i = 0; i < SAMPLES; i++) {
+		assert(rank[i] == hg64s_rank_of_value(hs, value[i]));
+		assert(quantile[i] == hg64s_quantile_of_value(hs, value[i]));
+	}
+	uint64_t t3 = nanotime();
+	printf("batch rank %.2f ns quantile %.2f ns single %.2f ns\n",
+	       (double)(t1 - t0) / SAMPLES, (double)(t2 - t1) / SAMPLES,
+	       (double)(t3 - t2) / SAMPLES / 2);
+	/* without an index the results are the same */
+	static uint64_t slow[SAMPLES];
+	hg64s_rank_of_values(hs, NULL, value, slow, SAMPLES);
+	assert(memcmp(rank, slow, sizeof(slow)) == 0);
+	/* values beyond the end of the snapshot */
+	uint64_t big[] = { 0, RANGE, UINT64_MAX / 2, UINT64_MAX };
+	hg64s_rank_of_values(hs, index, big, rank, 4);
+	hg64s_rank_of_values(hs, NULL, big, slow, 4);
+	for(size_t i = 0; i < 4; i++) {
+		assert(rank[i] == hg64s_rank_of_value(hs, big[i]));
+		assert(slow[i] == rank[i]);
+	}
+	free(index);
+}
+
+static void
+tail_stats(hg64 *hg, hg64s *hs) {
+	uint64_t pop = hg64_population(hg);
+	uint64_t count;
+	double sum, mean, hmean;
+	hg64_mean_variance(hg, &hmean, NULL);
+	hg64s_rank_range(hs, 0, pop, &count, &sum, &mean);
+	assert(count == pop);
+	assert(fabs(mean - hmean) / hmean < 1e-9);
+	/* the whole range is the sum of its parts */
+	double parts = 0.0;
+	for(uint64_t r = 0; r < pop; r += pop / 7 + 1) {
+		hg64s_rank_range(hs, r, r + pop / 7 + 1, NULL, &sum, NULL);
+		parts += sum;
+	}
+	assert(fabs(mean * pop - parts) / parts < 1e-9);
+	/* tail mean of uniformly distributed data */
+	hg64s_rank_range(hs, pop / 100 * 99, pop, &count, NULL, &mean);
+	printf("tail mean %f count %"PRIu64"\n", mean, count);
+	assert(fabs(mean - RANGE * 0.995) / RANGE < 0.01);
+	hg64s_value_range(hs, RANGE / 4, RANGE / 4 * 3, &count, NULL, &mean);
+	printf("range mean %f count %"PRIu64"\n", mean, count);
+	assert(fabs(mean - RANGE * 0.5) / RANGE < 0.01);
+	assert(fabs((double)count / pop - 0.5) < 0.01);
+	/* an empty range has a mean of zero, not NaN */
+	hg64s_rank_range(hs, pop / 2, pop / 2, &count, &sum, &mean);
+	assert(count == 0 && sum == 0.0 && mean == 0.0);
+}
+
+static void
+distance(hg64 *hg, hg64s *hs) {
+	double ks, w1;
+	hg64s_distance(hs, hs, &ks, &w1);
+	assert(ks == 0.0 && w1 == 0.0);
+	/* the same data at lower precision, and shifted */
+	hg64 *lo = hg64_create(SIGBITS - 2);
+	hg64 *sh = hg64_create(SIGBITS);
+	hg64_merge(lo, hg);
+	for(size_t i = 0; i < SAMPLES; i++) {
+		hg64_inc(sh, data[0][i] + RANGE / 10);
+	}
+	hg64s *los = hg64_snapshot(lo);
+	hg64s *shs = hg64_snapshot(sh);
+	uint64_t t0 = nanotime();
+	hg64s_distance(hs, los, &ks, &w1);
+	uint64_t t1 = nanotime();
+	printf("distance lo ks %f w1 %f in %.1f us\n",
+	       ks, w1, (double)(t1 - t0) / 1000);
+	assert(ks < 0.01 && w1 < RANGE / 1000);
+	hg64s_distance(hs, shs, &ks, &w1);
+	printf("distance shifted ks %f w1 %f\n", ks, w1);
+	assert(fabs(ks - 0.1) < 0.01);
+	assert(fabs(w1 - RANGE / 10) < RANGE / 100);
+	double q[] = { 0.5, 0.9, 0.99 };
+	double diff[3];
+	hg64s_quantile_diff(hs, shs, q, diff, 3);
+	for(size_t i = 0; i < 3; i++) {
+		assert(fabs(diff[i] - RANGE / 10) < RANGE / 100);
+	}
+	/* the same as separate queries, in any order */
+	double unsorted[] = { 0.99, 0.0, 0.25, 0.25, 1.0, 0.5 };
+	double udiff[6];
+	hg64s_quantile_diff(hs, shs, unsorted, udiff, 6);
+	for(size_t i = 0; i < 6; i++) {
+		double va = hg64s_value_at_quantile(hs, unsorted[i]);
+		double vb = hg64s_value_at_quantile(shs, unsorted[i]);
+		assert(udiff[i] == vb - va);
+	}
+	free(los);
+	free(shs);
+	hg64_destroy(lo);
+	hg64_destroy(sh);
+}
+
+static void
+columns(hg64 *hg, hg64s *hs) {
+	size_t size = hg64s_columns(hs, NULL, NULL, NULL, 0);
+	uint64_t *min = calloc(3 * size, sizeof(uint64_t));
+	uint64_t *max = calloc(3 * size, sizeof(uint64_t));
+	uint64_t *count = calloc(3 * size, sizeof(uint64_t));
+	int64_t offsets[4];
+	const hg64s *many[3] = { hs, hs, hs };
+	assert(hg64s_columns_many(many, 3, offsets, min, max, count,
+				  3 * size) == 3 * size);
+	assert(offsets[0] == 0 && offsets[3] == (int64_t)(3 * size));
+	size_t i = 0;
+	uint64_t hmin, hmax, hcount;
+	for(unsigned key = 0;
+	    hg64_get(hg, key, &hmin, &hmax, &hcount);
+	    key = hg64_next(hg, key)) {
+		if(hcount != 0) {
+			assert(min[i] == hmin);
+			assert(max[i] == hmax);
+			assert(count[i] == hcount);
+			assert(count[i + offsets[2]] == hcount);
+			i++;
+		}
+	}
+	assert(i == size);
+	free(min);
+	free(max);
+	free(count);
+}
+
+/*
+ * each group's count comes only from buckets inside its range
+ */
+static void
+log_buckets_match(hg64s *hs, size_t k) {
+	uint64_t min[64], max[64], count[64];
+	size_t n = hg64s_log_buckets(hs, k, min, max, count);
+	size_t cols = hg64s_columns(hs, NULL, NULL, NULL, 0);
+	uint64_t *cmin = malloc(sizeof(uint64_t) * cols * 3);
+	uint64_t *cmax = cmin + cols, *ccount = cmin + cols * 2;
+	hg64s_columns(hs, cmin, cmax, ccount, cols);
+	size_t c = 0;
+	for(size_t g = 0; g < n; g++) {
+		assert(g == 0 || min[g] == max[g - 1] + 1);
+		uint64_t total = 0;
+		for(; c < cols && cmax[c] <= max[g]; c++) {
+			assert(cmin[c] >= min[g]);
+			total += ccount[c];
+		}
+		assert(total == count[g]);
+	}
+	assert(c == cols);
+	free(cmin);
+}
+
+static void
+downsample(hg64s *hs) {
+	uint64_t pop = hg64s_rank_of_value(hs, UINT64_MAX);
+	uint64_t min[64], max[64], count[64];
+	/* keys 0 to 9, which 4 groups do not divide evenly */
+	hg64 *ten = hg64_create(SIGBITS);
+	for(uint64_t v = 0; v < 10; v++) {
+		hg64_add(ten, v, v + 1);
+	}
+	hg64s *tens = hg64_snapshot(ten);
+	log_buckets_match(tens, 4);
+	free(tens);
+	hg64_destroy(ten);
+	for(size_t k = 1; k <= 64; k++) {
+		log_buckets_match(hs, k);
+	}
+	for(size_t k = 1; k <= 64; k *= 4) {
+		size_t n = hg64s_log_buckets(hs, k, min, max, count);
+		uint64_t total = 0;
+		for(size_t g = 0; g < n; g++) {
+			assert(g == 0 || min[g] == max[g - 1] + 1);
+			total += count[g];
+		}
+		assert(n == k && total == pop);
+		n = hg64s_even_buckets(hs, k, min, max, count);
+		total = 0;
+		for(size_t g = 0; g < n; g++) {
+			assert(g == 0 || min[g] > max[g - 1]);
+			/* within the granularity of the histogram */
+			assert(k > 16 ||
+			       fabs((double)count[g] * n / pop - 1) < 0.3);
+			total += count[g];
+		}
+		assert((k > 16 || n == k) && total == pop);
+	}
+	const hg64s *series[3] = { hs, hs, hs };
+	uint64_t matrix[3 * 64];
+	hg64s_heatmap(series, 3, RANGE / 64, RANGE, 64, matrix);
+	uint64_t total = 0;
+	for(size_t g = 0; g < 64; g++) {
+		assert(matrix[g] == matrix[g + 64]);
+		assert(matrix[g] == matrix[g + 128]);
+		total += matrix[g];
+	}
+	assert(total == pop);
+}
+
+static void
+weighted(void) {
+	hg64 *plain = hg64_create(SIGBITS);
+	hg64 *whg = hg64_create_weighted(SIGBITS);
+	for(size_t i = 0; i < SAMPLES; i++) {
+		hg64_inc(plain, data[0][i]);
+		hg64_add_weight(whg, data[0][i], 0.25);
+	}
+	assert(hg64_population(whg) == SAMPLES / 4);
+	double pmean, wmean;
+	hg64_mean_variance(plain, &pmean, NULL);
+	hg64_mean_variance(whg, &wmean, NULL);
+	assert(fabs(pmean - wmean) / pmean < 1e-9);
+	hg64s *ws = hg64_snapshot(whg);
+	assert(hg64s_rank_of_value(ws, UINT64_MAX) == SAMPLES / 4);
+	double q = hg64s_quantile_of_value(ws, RANGE / 2);
+	assert(fabs(q - hg64_quantile_of_value(plain, RANGE / 2)) < 1e-3);
+	free(ws);
+	/* merging keeps the fractions */
+	hg64 *merged = hg64_create(SIGBITS);
+	hg64_merge(merged, whg);
+	assert(hg64_population(merged) == SAMPLES / 4);
+	/* scaling up is exact, scaling down keeps the population */
+	hg64 *scaled = hg64_create_totals(SIGBITS);
+	hg64_merge(scaled, plain);
+	hg64_scale(scaled, 3.0);
+	uint64_t count, scount;
+	for(unsigned key = 0;
+	    hg64_get(plain, key, NULL, NULL, &count);
+	    key = hg64_next(plain, key)) {
+		assert(hg64_get(scaled, key, NULL, NULL, &scount));
+		assert(scount == count * 3);
+	}
+	hg64_scale(scaled, 1.0 / 7.0);
+	assert(hg64_population(scaled) == SAMPLES * 3 / 7);
+	hg64_scale(whg, 4.0);
+	assert(hg64_population(whg) == SAMPLES);
+	/* weights that do not fit are ignored or saturated */
+	hg64 *odd = hg64_create_weighted(SIGBITS);
+	hg64_add_weight(odd, 1, NAN);
+	hg64_add_weight(odd, 1, -1.0);
+	hg64_add_weight(odd, 1, -INFINITY);
+	assert(hg64_population(odd) == 0);
+	hg64_add_weight(odd, 1, 0x1p44);
+	assert(hg64_population(odd) == (1ULL << 44) - 1);
+	hg64_clear(odd);
+	hg64_add_weight(odd, 1, INFINITY);
+	assert(hg64_population(odd) == (1ULL << 44) - 1);
+	hg64_destroy(odd);
+	odd = hg64_create(SIGBITS);
+	hg64_add_weight(odd, 1, 0x1p70);
+	assert(hg64_population(odd) == UINT64_MAX);
+	hg64_destroy(odd);
+	hg64_destroy(plain);
+	hg64_destroy(whg);
+	hg64_destroy(merged);
+	hg64_destroy(scaled);
+}
+
+static void
+pool(void) {
+	hg64pool *pool = hg64pool_create(hg64_create_totals, SIGBITS, 2);
+	hg64 *a = hg64pool_get(pool);
+	hg64 *b = hg64pool_get(pool);
+	hg64 *c = hg64pool_get(pool);
+	for(size_t i = 0; i < SAMPLES; i++) {
+		hg64_inc(a, data[0][i]);
+	}
+	size_t size = hg64_size(a);
+	hg64pool_put(pool, c);
+	hg64pool_put(pool, b);
+	hg64pool_put(pool, a);
+	/* the pool is full so `a` was destroyed */
+	assert(hg64pool_get(pool) == b);
+	hg64pool_put(pool, b);
+	uint64_t t0 = nanotime();
+	for(size_t i = 0; i < SAMPLES; i++) {
+		hg64 *hg = hg64pool_get(pool);
+		hg64_inc(hg, data[0][i]);
+		hg64pool_put(pool, hg);
+	}
+	uint64_t t1 = nanotime();
+	printf("pool churn %.2f ns per histogram\n",
+	       (double)(t1 - t0) / SAMPLES);
+	a = hg64pool_get(pool);
+	assert(hg64_population(a) == 0);
+	for(size_t i = 0; i < SAMPLES; i++) {
+		hg64_inc(a, data[0][i]);
+	}
+	assert(hg64_population(a) == SAMPLES);
+	hg64_clear(a);
+	assert(hg64_population(a) == 0);
+	assert(hg64_value_at_rank(a, 0) == UINT64_MAX);
+	/* clearing kept the bins */
+	assert(hg64_size(a) == size);
+	hg64_destroy(a);
+	hg64pool_destroy(pool);
+}
+
+static void
+compact(void) {
+	hg64 *hg = hg64_create_totals(SIGBITS);
+	size_t empty = hg64_size(hg);
+	for(size_t i = 0; i < SAMPLES; i++) {
+		hg64_inc(hg, data[0][i]);
+	}
+	size_t normal = hg64_size(hg);
+	/* a spike of huge values */
+	for(size_t i = 0; i < SAMPLES; i++) {
+		hg64_inc(hg, data[1][i] << 30);
+	}
+	assert(hg64_size(hg) > normal);
+	assert(hg64_compact(hg) == 0);
+	hg64_clear(hg);
+	assert(hg64_compact(hg) > 0);
+	assert(hg64_size(hg) == empty);
+	hg64_reclaim(hg);
+	for(size_t i = 0; i < SAMPLES; i++) {
+		hg64_inc(hg, data[0][i]);
+	}
+	assert(hg64_size(hg) == normal);
+	assert(hg64_population(hg) == SAMPLES);
+	/* removed bins are not reclaimed until later */
+	hg64_clear(hg);
+	hg64_compact(hg);
+	hg64_destroy(hg);
+}
+
+#define BINS_TOUCHED 64
+
+struct late_writer {
+	pthread_t tid;
+	hg64 *hg;
+	atomic_uint_fast64_t passes;
+	atomic_bool done;
+};
+
+/*
+ * every first increment in a bin races with compaction
+ */
+static void *
+late_writes(void *varg) {
+	struct late_writer *lw = varg;
+	for(unsigned i = 0; i < BINS_TOUCHED * 4; i++) {
+		hg64_inc(lw->hg, 1ULL << (i % BINS_TOUCHED));
+		atomic_fetch_add(&lw->passes, 1);
+	}
+	atomic_store(&lw->done, true);
+	return(NULL);
+}
+
+/*
+ * Compact while another thread is adding new bins, reclaiming after
+ * the writer has passed a quiescent point. Increments that land in
+ * a removed bin must be moved back, so no counts are lost.
+ */
+static void
+compact_concurrent(void) {
+	/* writes from another thread between compact and reclaim */
+	struct late_writer lw = { .hg = hg64_create(SIGBITS) };
+	atomic_init(&lw.passes, 0);
+	atomic_init(&lw.done, false);
+	late_writes(&lw);
+	hg64_clear(lw.hg);
+	assert(hg64_compact(lw.hg) == BINS_TOUCHED - SIGBITS + 1);
+	pthread_create(&lw.tid, NULL, late_writes, &lw);
+	pthread_join(lw.tid, NULL);
+	hg64_reclaim(lw.hg);
+	assert(hg64_population(lw.hg) == BINS_TOUCHED * 4);
+	hg64_destroy(lw.hg);
+	for(unsigned r = 0; r < 100; r++) {
+		struct late_writer lw = { .hg = hg64_create(SIGBITS) };
+		atomic_init(&lw.passes, 0);
+		atomic_init(&lw.done, false);
+		pthread_create(&lw.tid, NULL, late_writes, &lw);
+		while(!atomic_load(&lw.done)) {
+			hg64_compact(lw.hg);
+			uint64_t passes = atomic_load(&lw.passes);
+			while(atomic_load(&lw.passes) == passes &&
+			      !atomic_load(&lw.done)) {
+			}
+			hg64_reclaim(lw.hg);
+		}
+		pthread_join(lw.tid, NULL);
+		hg64_reclaim(lw.hg);
+		assert(hg64_population(lw.hg) == BINS_TOUCHED * 4);
+		hg64_destroy(lw.hg);
+	}
+}
+
+static void *
+clear_writes(void *varg) {
+	struct late_writer *lw = varg;
+	while(!atomic_load(&lw->done)) {
+		hg64_inc(lw->hg, RANGE);
+	}
+	return(NULL);
+}
+
+/*
+ * Clear while another thread is adding, so some of its increments
+ * fall between a counter and its bin's running total. Afterwards
+ * the totals must still agree with the counters.
+ */
+static void
+clear_concurrent(void) {
+	struct late_writer lw = { .hg = hg64_create_totals(SIGBITS) };
+	atomic_init(&lw.passes, 0);
+	atomic_init(&lw.done, false);
+	pthread_create(&lw.tid, NULL, clear_writes, &lw);
+	for(unsigned r = 0; r < 100000; r++) {
+		hg64_clear(lw.hg);
+	}
+	atomic_store(&lw.done, true);
+	pthread_join(lw.tid, NULL);
+	uint64_t count, sum = 0;
+	for(unsigned key = 0; hg64_get(lw.hg, key, NULL, NULL, &count);
+	    key++) {
+		sum += count;
+	}
+	assert(hg64_population(lw.hg) == sum);
+	hg64_destroy(lw.hg);
+}
+
+static void
+same_counts(hg64 *a, hg64 *b, bool same) {
+	bool differ = false;
+	uint64_t ac, bc;
+	for(unsigned key = 0; hg64_get(a, key, NULL, NULL, &ac); key++) {
+		assert(hg64_get(b, key, NULL, NULL, &bc));
+		differ |= ac != bc;
+	}
+	assert(same != differ);
+}
+
+static void
+clone(void) {
+	hg64 *orig = hg64_create_totals(SIGBITS);
+	hg64 *parent = hg64_create_totals(SIGBITS);
+	for(size_t i = 0; i < SAMPLES; i++) {
+		hg64_inc(orig, data[0][i]);
+		hg64_inc(parent, data[0][i]);
+	}
+	uint64_t t0 = nanotime();
+	hg64 *child = hg64_clone(parent);
+	uint64_t t1 = nanotime();
+	printf("clone time %.0f ns\n", (double)(t1 - t0));
+	hg64 *grandchild = hg64_clone(child);
+	same_counts(parent, child, true);
+	same_counts(parent, grandchild, true);
+	assert(hg64_population(child) == SAMPLES);
+	/* writes to a clone do not affect the others */
+	hg64_inc(child, RANGE / 2);
+	same_counts(orig, parent, true);
+	same_counts(orig, child, false);
+	same_counts(orig, grandchild, true);
+	assert(hg64_population(child) == SAMPLES + 1);
+	for(size_t i = 0; i < SAMPLES; i++) {
+		hg64_inc(parent, data[1][i]);
+	}
+	same_counts(orig, child, false);
+	same_counts(orig, grandchild, true);
+	assert(hg64_population(parent) == SAMPLES * 2);
+	hg64_destroy(child);
+	hg64_clear(grandchild);
+	assert(hg64_population(grandchild) == 0);
+	hg64_reclaim(grandchild);
+	hg64_reclaim(parent);
+	hg64_destroy(parent);
+	hg64_destroy(grandchild);
+	hg64_destroy(orig);
+}
+
+struct clone_reader {
+	pthread_t tid;
+	hg64 *hg;
+	atomic_bool stop;
+};
+
+static void *
+clone_reads(void *varg) {
+	struct clone_reader *cr = varg;
+	uint64_t count;
+	while(!atomic_load(&cr->stop)) {
+		for(unsigned key = 0; hg64_get(cr->hg, key, NULL, NULL, &count);
+		    key = hg64_next(cr->hg, key)) {
+		}
+	}
+	return(NULL);
+}
+
+/*
+ * The parent stops sharing a bin first, then the clone drops the last
+ * reference; reclaiming the clone must not free the bin while the
+ * parent's readers might still be using it.
+ */
+static void
+clone_reclaim(void) {
+	hg64 *parent = hg64_create(SIGBITS);
+	struct clone_reader cr = { .hg = parent };
+	atomic_init(&cr.stop, false);
+	pthread_create(&cr.tid, NULL, clone_reads, &cr);
+	for(unsigned r = 0; r < 1000; r++) {
+		hg64_inc(parent, r);
+		hg64 *child = hg64_clone(parent);
+		hg64_inc(parent, r);
+		hg64_inc(child, r);
+		hg64_reclaim(child);
+		hg64_destroy(child);
+		assert(hg64_population(parent) == 2 * r + 2);
+	}
+	atomic_store(&cr.stop, true);
+	pthread_join(cr.tid, NULL);
+	hg64_reclaim(parent);
+	hg64_destroy(parent);
+}
+
+static void
+merge_snapshots(hg64 *hg, hg64s *hs) {
+	hg64 *lo = hg64_create(SIGBITS - 1);
+	hg64_merge(lo, hg);
+	hg64s *los = hg64_snapshot(lo);
+	uint64_t t0 = nanotime();
+	hg64s *two = hg64s_merge(hs, hs);
+	uint64_t t1 = nanotime();
+	hg64s *mixed = hg64s_merge(hs, los);
+	uint64_t t2 = nanotime();
+	printf("snapshot merge %.1f us mixed %.1f us\n",
+	       (double)(t1 - t0) / 1000, (double)(t2 - t1) / 1000);
+	uint64_t pop = hg64s_rank_of_value(hs, UINT64_MAX);
+	assert(hg64s_rank_of_value(two, UINT64_MAX) == pop * 2);
+	assert(hg64s_rank_of_value(mixed, UINT64_MAX) == pop * 2);
+	/* merging into a histogram is the same as hg64_merge() */
+	hg64 *copy = hg64_create(SIGBITS);
+	hg64_merge_snapshot(copy, hs);
+	same_counts(hg, copy, true);
+	hg64 *low = hg64_create(SIGBITS - 1);
+	hg64_merge_snapshot(low, hs);
+	same_counts(lo, low, true);
+	/* folding to lower precision is exact */
+	hg64_merge_snapshot(low, hs);
+	hg64s *lows = hg64_snapshot(low);
+	for(double q = 0.0; q < 1.0; q += 0.0625) {
+		assert(hg64s_value_at_quantile(lows, q) ==
+		       hg64s_value_at_quantile(mixed, q));
+	}
+	free(two);
+	free(mixed);
+	free(los);
+	free(lows);
+	hg64_destroy(lo);
+	hg64_destroy(low);
+	hg64_destroy(copy);
+}
+
+static void
+snapshot_speed(hg64 *hg) {
+	for(unsigned sigbits = 1; sigbits < 16; sigbits++) {
+		hg64 *shg = hg64_create(sigbits);
+		hg64_merge(shg, hg);
+		unsigned reps = 1000 >> (sigbits / 2);
+		uint64_t t0 = nanotime();
+		for(unsigned r = 0; r < reps; r++) {
+			free(hg64_snapshot(shg));
+		}
+		uint64_t t1 = nanotime();
+		size_t size = hg64_size(shg);
+		double ns = (double)(t1 - t0) / reps;
+		printf("snapshot %2u sigbits %8zu bytes %9.0f ns %5.2f ns/kB\n",
+		       sigbits, size, ns, ns * 1024 / size);
+		hg64_destroy(shg);
+	}
+}
+
+struct memo_thread {
+	pthread_t tid;
+	hg64s *hs;
+	uint64_t *expect;
+};
+
+static void *
+memo_queries(void *varg) {
+	struct memo_thread *mt = varg;
+	double quantile[] = { 0.5, 0.9, 0.99, 0.999 };
+	for(unsigned r = 0; r < 10000; r++) {
+		unsigned i = r % 4;
+		uint64_t value = hg64s_value_at_quantile(mt->hs, quantile[i]);
+		assert(value == mt->expect[i]);
+	}
+	return(NULL);
+}
+
+static void
+memo(hg64 *hg) {
+	double quantile[] = { 0.5, 0.9, 0.99, 0.999 };
+	uint64_t expect[4];
+	hg64s *hs = hg64_snapshot(hg);
+	hg64s *fresh = hg64_snapshot(hg);
+	uint64_t t0 = nanotime();
+	for(unsigned i = 0; i < 4; i++) {
+		expect[i] = hg64s_value_at_quantile(hs, quantile[i]);
+	}
+	uint64_t t1 = nanotime();
+	for(unsigned i = 0; i < 4; i++) {
+		assert(hg64s_value_at_quantile(hs, quantile[i]) == expect[i]);
+	}
+	uint64_t t2 = nanotime();
+	printf("quantiles first %.0f ns memo %.0f ns\n",
+	       (double)(t1 - t0) / 4, (double)(t2 - t1) / 4);
+	/* concurrent queries may collide in the memo */
+	struct memo_thread thread[THREADS];
+	for(unsigned t = 0; t < THREADS; t++) {
+		thread[t] = (struct memo_thread){ .hs = fresh, .expect = expect };
+		assert(pthread_create(&thread[t].tid, NULL,
+				      memo_queries, &thread[t]) == 0);
+	}
+	for(unsigned t = 0; t < THREADS; t++) {
+		assert(pthread_join(thread[t].tid, NULL) == 0);
+	}
+	free(hs);
+	free(fresh);
+}
+
+struct pub_thread {
+	pthread_t tid;
+	hg64pub *pub;
+};
+
+static void *
+pub_reader(void *varg) {
+	struct pub_thread *pt = varg;
+	uint64_t last = 0;
+	for(unsigned r = 0; r < 100000; r++) {
+		const hg64s *hs = hg64pub_get(pt->pub);
+		uint64_t pop = hg64s_rank_of_value(hs, UINT64_MAX);
+		uint64_t p99 = hg64s_value_at_quantile(hs, 0.99);
+		assert(pop >= last);
+		assert(pop == 0 || p99 < RANGE);
+		last = pop;
+		hg64pub_put(hs);
+	}
+	return(NULL);
+}
+
+static void
+publisher(hg64 *hg) {
+	hg64 *phg = hg64_create(SIGBITS);
+	hg64pub *pub = hg64pub_create(phg, 1);
+	assert(pub != NULL);
+	assert(hg64pub_create(phg, 0) == NULL);
+	const hg64s *empty = hg64pub_get(pub);
+	assert(hg64s_rank_of_value(empty, UINT64_MAX) == 0);
+	hg64_merge(phg, hg);
+	hg64pub_refresh(pub);
+	const hg64s *full = hg64pub_get(pub);
+	uint64_t pop = hg64_population(hg);
+	assert(hg64s_rank_of_value(full, UINT64_MAX) == pop);
+	/* the old snapshot is still usable */
+	assert(hg64s_rank_of_value(empty, UINT64_MAX) == 0);
+	hg64pub_put(empty);
+	/* readers see the background thread's snapshots while we write */
+	struct pub_thread thread[THREADS];
+	for(unsigned t = 0; t < THREADS; t++) {
+		thread[t] = (struct pub_thread){ .pub = pub };
+		assert(pthread_create(&thread[t].tid, NULL,
+				      pub_reader, &thread[t]) == 0);
+	}
+	uint64_t t0 = nanotime();
+	for(size_t i = 0; i < SAMPLES; i++) {
+		hg64_inc(phg, data[0][i]);
+	}
+	for(unsigned t = 0; t < THREADS; t++) {
+		assert(pthread_join(thread[t].tid, NULL) == 0);
+	}
+	uint64_t t1 = nanotime();
+	hg64pub_refresh(pub);
+	const hg64s *hs = hg64pub_get(pub);
+	assert(hg64s_rank_of_value(hs, UINT64_MAX) == pop + SAMPLES);
+	hg64pub_put(hs);
+	printf("publisher %.1f ms\n", (double)(t1 - t0) / NS_PER_MS);
+	/* many references to one snapshot, some held across a refresh */
+	const hg64s **held = malloc(sizeof(*held) * 20000);
+	for(unsigned i = 0; i < 20000; i++) {
+		held[i] = hg64pub_get(pub);
+		if(i == 10000) {
+			hg64pub_refresh(pub);
+		}
+	}
+	for(unsigned i = 0; i < 20000; i++) {
+		assert(hg64s_rank_of_value(held[i], UINT64_MAX) ==
+		       pop + SAMPLES);
+		hg64pub_put(held[i]);
+	}
+	free(held);
+	hg64pub_destroy(pub);
+	/* snapshots outlive their publisher */
+	assert(hg64s_rank_of_value(full, UINT64_MAX) == pop);
+	hg64pub_put(full);
+	hg64_destroy(phg);
+}
+
+static void
+same_snapshot(const hg64s *a, const hg64s *b) {
+	size_t n = hg64s_columns(a, NULL, NULL, NULL, 0);
+	assert(hg64s_columns(b, NULL, NULL, NULL, 0) == n);
+	uint64_t *ac = malloc(sizeof(uint64_t) * n * 4);
+	uint64_t *bc = ac + n, *am = ac + 2 * n, *bm = ac + 3 * n;
+	hg64s_columns(a, am, NULL, ac, n);
+	hg64s_columns(b, bm, NULL, bc, n);
+	for(size_t i = 0; i < n; i++) {
+		assert(am[i] == bm[i] && ac[i] == bc[i]);
+	}
+	free(ac);
+}
+
+static hg64s *
+round_trip(const hg64s *hs, size_t *psize) {
+	size_t size = hg64s_encode(hs, NULL, 0);
+	uint8_t *buf = malloc(size);
+	assert(hg64s_encode(hs, buf, size) == size);
+	hg64s *copy = hg64s_decode(buf, size);
+	assert(copy != NULL);
+	assert(hg64s_decode(buf, size - 1) == NULL);
+	same_snapshot(hs, copy);
+	free(buf);
+	*psize = size;
+	return(copy);
+}
+
+static void
+codec(hg64 *hg) {
+	size_t size;
+	hg64 *ehg = hg64_create(SIGBITS);
+	hg64s *hs = hg64_snapshot(ehg);
+	free(round_trip(hs, &size));
+	free(hs);
+	/* extreme counts */
+	hg64_add(ehg, 1, UINT64_MAX / 3);
+	hg64_add(ehg, RANGE, UINT64_MAX / 3);
+	hg64_inc(ehg, UINT64_MAX);
+	hs = hg64_snapshot(ehg);
+	free(round_trip(hs, &size));
+	free(hs);
+	hg64_destroy(ehg);
+	unsigned sigbits[] = { 1, SIGBITS, 10, 15 };
+	for(unsigned i = 0; i < 4; i++) {
+		hg64 *shg = hg64_create(sigbits[i]);
+		hg64_merge(shg, hg);
+		hs = hg64_snapshot(shg);
+		hg64s *copy = round_trip(hs, &size);
+		double raw = (double)hg64_size(shg);
+		uint8_t *buf = malloc(size);
+		hg64s_encode(hs, buf, size);
+		unsigned reps = 1000 >> (sigbits[i] / 2);
+		uint64_t t0 = nanotime();
+		for(unsigned r = 0; r < reps; r++) {
+			free(hg64s_decode(buf, size));
+		}
+		uint64_t t1 = nanotime();
+		printf("codec %2u sigbits %8.0f bytes -> %7zu ratio %5.1f "
+		       "decode %4.0f MB/s\n", sigbits[i], raw, size,
+		       raw / (double)size, raw * reps * 1000 / (t1 - t0));
+		free(buf);
+		free(copy);
+		free(hs);
+		hg64_destroy(shg);
+	}
+}
+
+static void
+series(void) {
+	enum { FRAMES = 60 };
+	hg64s *hs[FRAMES];
+	hg64 *hg = hg64_create(SIGBITS);
+	hg64series *ts = hg64series_create(SIGBITS, 30);
+	assert(hg64series_create(SIGBITS, 0) == NULL);
+	size_t independent = 0;
+	for(size_t i = 0; i < FRAMES; i++) {
+		/* a steady workload plus a little noise */
+		for(size_t j = 0; j < 1000; j++) {
+			hg64_inc(hg, data[0][j]);
+		}
+		for(size_t j = 0; j < 10; j++) {
+			hg64_inc(hg, data[1][i * 10 + j]);
+		}
+		hs[i] = hg64_snapshot(hg);
+		independent += hg64s_encode(hs[i], NULL, 0);
+		assert(hg64series_append(ts, hs[i]) == 0);
+	}
+	size_t size;
+	const uint8_t *buf = hg64series_data(ts, &size);
+	assert(hg64series_count(buf, size) == FRAMES);
+	printf("series %d snapshots %zu bytes independent %zu ratio %.1f\n",
+	       FRAMES, size, independent, (double)independent / size);
+	for(size_t i = 0; i < FRAMES; i++) {
+		hg64s *point = hg64series_point(buf, size, i);
+		same_snapshot(hs[i], point);
+		free(point);
+	}
+	assert(hg64series_point(buf, size, FRAMES) == NULL);
+	assert(hg64series_point(buf, size - 1, FRAMES - 1) == NULL);
+	hg64s *merged = hg64s_merge(hs[20], hs[21]);
+	for(size_t i = 22; i < 40; i++) {
+		hg64s *more = hg64s_merge(merged, hs[i]);
+		free(merged);
+		merged = more;
+	}
+	uint64_t t0 = nanotime();
+	hg64s *sum = hg64series_sum(buf, size, 20, 40);
+	uint64_t t1 = nanotime();
+	printf("series sum of 20 %.1f us\n", (double)(t1 - t0) / 1000);
+	same_snapshot(merged, sum);
+	free(merged);
+	free(sum);
+	for(size_t i = 0; i < FRAMES; i++) {
+		free(hs[i]);
+	}
+	hg64series_destroy(ts);
+	/* keyframes larger than the initial buffer */
+	ts = hg64series_create(SIGBITS, 2);
+	for(size_t i = 0; i < SAMPLES; i++) {
+		hg64_inc(hg, data[2][i] << (i % 32));
+	}
+	hs[0] = hg64_snapshot(hg);
+	assert(hg64s_encode(hs[0], NULL, 0) > 1024);
+	for(size_t i = 0; i < 3; i++) {
+		assert(hg64series_append(ts, hs[0]) == 0);
+	}
+	buf = hg64series_data(ts, &size);
+	for(size_t i = 0; i < 3; i++) {
+		hg64s *point = hg64series_point(buf, size, i);
+		same_snapshot(hs[0], point);
+		free(point);
+	}
+	free(hs[0]);
+	hg64series_destroy(ts);
+	hg64_destroy(hg);
+}
+
+static void
+mapped(hg64s *hs) {
+	size_t size = hg64s_save(hs, NULL, 0);
+	uint64_t *buf = malloc(size + sizeof(uint64_t));
+	assert(hg64s_save(hs, buf, size) == size);
+	uint64_t t0 = nanotime();
+	const hg64s *ms = hg64s_map(buf, size);
+	uint64_t t1 = nanotime();
+	assert(ms != NULL);
+	assert(hg64s_map(buf, size - 1) == NULL);
+	assert(hg64s_map((uint8_t *)buf + 4, size) == NULL);
+	same_snapshot(hs, ms);
+	for(double q = 0.0; q < 1.0; q += 0.0625) {
+		uint64_t value = hg64s_value_at_quantile(hs, q);
+		assert(hg64s_value_at_quantile(ms, q) == value);
+		assert(hg64s_rank_of_value(ms, value) ==
+		       hg64s_rank_of_value(hs, value));
+	}
+	/* queries work on a read-only mapping */
+	char name[] = "/tmp/hg64s.XXXXXX";
+	int fd = mkstemp(name);
+	assert(fd >= 0);
+	assert(write(fd, buf, size) == (ssize_t)size);
+	void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	assert(map != MAP_FAILED);
+	const hg64s *fs = hg64s_map(map, size);
+	assert(fs != NULL);
+	for(double q = 0.0; q < 1.0; q += 0.0625) {
+		assert(hg64s_value_at_quantile(fs, q) ==
+		       hg64s_value_at_quantile(hs, q));
+	}
+	printf("mapped snapshot %zu bytes open %.0f ns\n",
+	       size, (double)(t1 - t0));
+	munmap(map, size);
+	close(fd);
+	unlink(name);
+	buf[0] ^= 1ULL << 40;
+	assert(hg64s_map(buf, size) == NULL);
+	buf[0] ^= 1ULL << 40;
+	/* tampering is rejected, or at least queries do not crash */
+	size_t rejected = 0;
+	for(size_t i = 0; i < size / sizeof(uint64_t); i++) {
+		buf[i] ^= 1ULL << 40;
+		const hg64s *ts = hg64s_map(buf, size);
+		rejected += ts == NULL;
+		for(double q = 0.0; ts != NULL && q < 1.0; q += 0.0625) {
+			hg64s_rank_of_value(ts, hg64s_value_at_quantile(ts, q));
+		}
+		buf[i] ^= 1ULL << 40;
+	}
+	assert(rejected >= 64 * 2);
+	assert(hg64s_map(buf, size) == ms);
+	free(buf);
+}
+
+static void
+lossy(hg64s *hs) {
+	size_t n = hg64s_columns(hs, NULL, NULL, NULL, 0);
+	uint64_t *min = malloc(sizeof(uint64_t) * n * 2);
+	uint64_t *max = min + n;
+	hg64s_columns(hs, min, max, NULL, n);
+	uint64_t pop = hg64s_rank_of_value(hs, UINT64_MAX);
+	double eps[] = { 0.0, 0.001, 0.01, 0.05 };
+	for(unsigned e = 0; e < 4; e++) {
+		double error;
+		size_t buckets;
+		hg64s *cs = hg64s_compact(hs, eps[e], &error, &buckets);
+		assert(error <= eps[e]);
+		assert(hg64s_rank_of_value(cs, UINT64_MAX) == pop);
+		assert(eps[e] > 0.0 || buckets == n);
+		for(size_t i = 0; i < n; i++) {
+			uint64_t mid = min[i] + (max[i] - min[i]) / 2;
+			uint64_t value[] = { min[i], mid, max[i] };
+			for(unsigned v = 0; v < 3; v++) {
+				double a = hg64s_rank_of_value(hs, value[v]);
+				double b = hg64s_rank_of_value(cs, value[v]);
+				assert(fabs(a - b) <= error * pop + 1);
+			}
+		}
+		printf("compact eps %.3f error %.4f buckets %zu -> %zu "
+		       "encoded %zu -> %zu bytes\n", eps[e], error, n, buckets,
+		       hg64s_encode(hs, NULL, 0), hg64s_encode(cs, NULL, 0));
+		free(cs);
+	}
+	free(min);
+}
+
+static uint64_t
+pb_varint(const uint8_t **pp) {
+	uint64_t val = 0;
+	for(unsigned shift = 0; ; shift += 7) {
+		uint8_t byte = *(*pp)++;
+		val |= (uint64_t)(byte & 0x7f) << shift;
+		if(byte < 0x80) {
+			return(val);
+		}
+	}
+}
+
+static uint64_t
+pb_fixed64(const uint8_t **pp) {
+	uint64_t val = 0;
+	for(unsigned i = 0; i < 8; i++) {
+		val |= (uint64_t)*(*pp)++ << (8 * i);
+	}
+	return(val);
+}
+
+static void
+otlp(hg64 *hg) {
+	for(unsigned sigbits = 1; sigbits <= 10; sigbits++) {
+		hg64 *ohg = hg64_create(sigbits);
+		hg64_merge(ohg, hg);
+		hg64_add(ohg, 0, 3);
+		hg64s *hs = hg64_snapshot(ohg);
+		size_t size = hg64s_otlp(hs, 1, 2, NULL, 0);
+		uint8_t *buf = malloc(size);
+		assert(hg64s_otlp(hs, 1, 2, buf, size) == size);
+		/* expected counts, using libm */
+		size_t n = hg64s_columns(hs, NULL, NULL, NULL, 0);
+		uint64_t *min = malloc(sizeof(uint64_t) * n * 3);
+		uint64_t *max = min + n, *count = min + 2 * n;
+		hg64s_columns(hs, min, max, count, n);
+		double per = (double)(1 << (sigbits - 1));
+		int64_t lo = INT64_MAX;
+		for(size_t i = 1; i < n; i++) {
+			/* exact values or bucket centres */
+			double mid = min[i] == max[i] ? (double)min[i] :
+				(double)min[i] / 2 + (double)max[i] / 2 + 0.5;
+			int64_t index = (int64_t)ceil(log2(mid) * per) - 1;
+			lo = index < lo ? index : lo;
+			max[i] = (uint64_t)index;
+		}
+		const uint8_t *p = buf, *end = buf + size;
+		uint64_t zero = 0, pop = 0, scale = 0;
+		int64_t offset = 0;
+		while(p < end) {
+			uint64_t tag = pb_varint(&p);
+			if(tag == (4 << 3 | 1)) {
+				pop = pb_fixed64(&p);
+			} else if(tag == (6 << 3 | 0)) {
+				scale = pb_varint(&p);
+			} else if(tag == (7 << 3 | 1)) {
+				zero = pb_fixed64(&p);
+			} else if(tag == (8 << 3 | 2)) {
+				uint64_t len = pb_varint(&p);
+				const uint8_t *sub = p + len;
+				while(p < sub) {
+					tag = pb_varint(&p);
+					if(tag == (1 << 3 | 0)) {
+						uint64_t z = pb_varint(&p);
+						offset = (int64_t)(z >> 1) ^
+							 -(int64_t)(z & 1);
+						continue;
+					}
+					assert(tag == (2 << 3 | 2));
+					len = pb_varint(&p);
+					const uint8_t *pk = p + len;
+					for(int64_t i = offset; p < pk; i++) {
+						uint64_t c = pb_varint(&p);
+						for(size_t j = 1; j < n; j++) {
+							if((int64_t)max[j] == i) {
+								c -= count[j];
+							}
+						}
+						assert(c == 0);
+					}
+				}
+			} else {
+				assert((tag & 7) == 1);
+				pb_fixed64(&p);
+			}
+		}
+		assert(pop == hg64s_rank_of_value(hs, UINT64_MAX));
+		assert(zero == 3 && scale == (sigbits - 1) * 2);
+		assert(offset == lo);
+		if(sigbits == SIGBITS) {
+			printf("otlp %u sigbits %zu buckets %zu bytes\n",
+			       sigbits, n, size);
+		}
+		free(min);
+		free(buf);
+		free(hs);
+		hg64_destroy(ohg);
+	}
+}
+
+/*
+ * fetch a URL path from the server, returning the response body
+ */
+static int
+http_connect(unsigned port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(fd >= 0);
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_port = htons((uint16_t)port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	assert(connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+	return(fd);
+}
+
+/*
+ * fetch a URL path from the server with extra request headers,
+ * returning the response
+ */
+static char *
+http_get(unsigned port, const char *path, const char *headers) {
+	int fd = http_connect(port);
+	char req[256];
+	int len = snprintf(req, sizeof(req),
+			   "GET %s HTTP/1.1\r\nHost: localhost\r\n%s\r\n",
+			   path, headers);
+	assert(write(fd, req, (size_t)len) == len);
+	size_t size = 0, cap = 4096;
+	char *buf = malloc(cap);
+	for(;;) {
+		if(cap - size < 1024) {
+			buf = realloc(buf, cap *= 2);
+		}
+		ssize_t n = read(fd, buf + size, cap - size - 1);
+		assert(n >= 0);
+		if(n == 0) {
+			break;
+		}
+		size += (size_t)n;
+	}
+	buf[size] = '\0';
+	close(fd);
+	return(buf);
+}
+
+static void
+http(hg64 *hg) {
+	hg64 *live = hg64_create_totals(SIGBITS);
+	hg64http *srv = hg64http_create(0);
+	assert(srv != NULL);
+	unsigned port = hg64http_port(srv);
+	assert(port != 0);
+	assert(hg64http_register(srv, "9lives", "", live) == -1);
+	assert(hg64http_register(srv, "test_load", "test data", hg) == 0);
+	assert(hg64http_register(srv, "live_ns", "a\\b\nc", live) == 0);
+	char *resp = http_get(port, "/nonesuch", "");
+	assert(strncmp(resp, "HTTP/1.1 404 ", 13) == 0);
+	free(resp);
+	uint64_t t0 = nanotime();
+	resp = http_get(port, "/metrics", "");
+	uint64_t t1 = nanotime();
+	assert(strncmp(resp, "HTTP/1.1 200 OK\r\n", 17) == 0);
+	char expect[64];
+	snprintf(expect, sizeof(expect), "\ntest_load_count %"PRIu64"\n",
+		 hg64_population(hg));
+	assert(strstr(resp, expect) != NULL);
+	assert(strstr(resp, "\nlive_ns_count 0\n") != NULL);
+	assert(strstr(resp, "# HELP live_ns a\\\\b\\nc\n") != NULL);
+	assert(hg64http_renders(srv) == 2);
+	/* unchanged histograms are not rendered again */
+	char *again = http_get(port, "/metrics", "");
+	uint64_t t2 = nanotime();
+	assert(strcmp(resp, again) == 0);
+	assert(hg64http_renders(srv) == 2);
+	free(again);
+	hg64_inc(live, 1000);
+	again = http_get(port, "/metrics?x", "");
+	assert(strstr(again, "\nlive_ns_bucket{le=\"1007\"} 1\n") != NULL);
+	assert(hg64http_renders(srv) == 3);
+	free(again);
+	/* the same population with different counts is a change */
+	hg64_clear(live);
+	hg64_inc(live, 2000);
+	again = http_get(port, "/metrics", "");
+	assert(strstr(again, "\nlive_ns_bucket{le=\"2015\"} 1\n") != NULL);
+	assert(hg64http_renders(srv) == 4);
+	printf("http scrape %zu bytes first %.0f us cached %.0f us\n",
+	       strlen(resp), (double)(t1 - t0) / 1000,
+	       (double)(t2 - t1) / 1000);
+	free(again);
+	free(resp);
+	/* fractional weights are changes, though the population is not */
+	hg64 *whg = hg64_create_weighted(SIGBITS);
+	assert(hg64http_register(srv, "weighted", "", whg) == 0);
+	for(unsigned i = 1; i <= 2; i++) {
+		hg64_add_weight(whg, 1000, 0.1);
+		again = http_get(port, "/metrics", "");
+		assert(strstr(again, "\nweighted_count 0\n") != NULL);
+		assert(hg64http_renders(srv) == 4 + i);
+		free(again);
+	}
+	/* OpenMetrics has its own content type and an end marker */
+	resp = http_get(port, "/metrics",
+			"Accept: application/openmetrics-text;"
+			"version=1.0.0,text/plain;q=0.5\r\n");
+	assert(strstr(resp, "\r\nContent-Type: application/openmetrics-text;")
+	       != NULL);
+	assert(strcmp(resp + strlen(resp) - 7, "\n# EOF\n") == 0);
+	free(resp);
+	resp = http_get(port, "/metrics", "Accept: text/plain\r\n");
+	assert(strstr(resp, "# EOF") == NULL);
+	free(resp);
+	/* an idle client does not hold up the others */
+	int idle = http_connect(port);
+	assert(write(idle, "GET", 3) == 3);
+	t0 = nanotime();
+	resp = http_get(port, "/metrics", "");
+	t1 = nanotime();
+	assert(strncmp(resp, "HTTP/1.1 200 OK\r\n", 17) == 0);
+	assert(t1 - t0 < NS_PER_S / 2);
+	free(resp);
+	close(idle);
+	hg64http_destroy(srv);
+	hg64_destroy(live);
+	hg64_destroy(whg);
+}
+
+static void
+kernels(hg64 *hg) {
+	const char *name[] = { "avx512", "avx2", "lzcnt", "scalar" };
+	const char *best = hg64_kernel(NULL);
+	/* awkward values, and a length that is not a multiple of 8 */
+	uint64_t edge[131];
+	for(unsigned i = 0; i < 64; i++) {
+		edge[i * 2] = 1ULL << i;
+		edge[i * 2 + 1] = (1ULL << i) - 1;
+	}
+	edge[128] = UINT64_MAX;
+	edge[129] = UINT64_MAX - 1;
+	edge[130] = 0;
+	/* every variant must match the portable one */
+	assert(strcmp(hg64_kernel("scalar"), "scalar") == 0);
+	hg64s *hs = hg64_snapshot(hg);
+	hg64s *expect = hg64s_merge(hs, hs);
+	assert(strcmp(hg64_kernel(best), best) == 0);
+	assert(hg64_kernel("nonsense") == NULL);
+	assert(strcmp(hg64_kernel(NULL), best) == 0);
+	for(unsigned k = 0; k < 4; k++) {
+		if(hg64_kernel(name[k]) == NULL) {
+			printf("kernel %s unsupported\n", name[k]);
+			continue;
+		}
+		assert(strcmp(hg64_kernel(NULL), name[k]) == 0);
+		for(unsigned sigbits = 1; sigbits < 16; sigbits++) {
+			hg64 *ref = hg64_create(sigbits);
+			hg64 *arr = hg64_create(sigbits);
+			for(unsigned i = 0; i < 131; i++) {
+				hg64_inc(ref, edge[i]);
+			}
+			hg64_add_array(arr, edge, 131);
+			same_counts(ref, arr, true);
+			hg64_destroy(ref);
+			hg64_destroy(arr);
+		}
+		hg64 *ahg = hg64_create(SIGBITS);
+		uint64_t t0 = nanotime();
+		hg64_add_array(ahg, data[0], SAMPLES);
+		uint64_t t1 = nanotime();
+		hg64s *merged = hg64s_merge(hs, hs);
+		uint64_t t2 = nanotime();
+		same_snapshot(merged, expect);
+		uint64_t pop[2];
+		double sum[2];
+		hg64s_rank_range(merged, 0, UINT64_MAX, &pop[0], &sum[0], NULL);
+		hg64s_rank_range(expect, 0, UINT64_MAX, &pop[1], &sum[1], NULL);
+		assert(pop[0] == pop[1] && sum[0] == sum[1]);
+		hg64 *ref = hg64_create(SIGBITS);
+		for(size_t i = 0; i < SAMPLES; i++) {
+			hg64_inc(ref, data[0][i]);
+		}
+		same_counts(ref, ahg, true);
+		printf("kernel %-6s %5.2f ns/value %.0f ns/merge\n", name[k],
+		       (double)(t1 - t0) / SAMPLES, (double)(t2 - t1));
+		hg64_destroy(ref);
+		hg64_destroy(ahg);
+		free(merged);
+	}
+	assert(strcmp(hg64_kernel(best), best) == 0);
+	free(expect);
+	free(hs);
+}
+
+static void
+crossed(void *arg, unsigned watch, uint64_t value, bool above) {
+	unsigned *calls = arg;
+	calls[watch] += 1;
+	printf("tracker %u %s threshold at %"PRIu64"\n",
+	       watch, above ? "above" : "below", value);
+}
+
+static void
+tracker(void) {
+	double quantile[] = { 0.5, 0.9, 0.99, 0.999 };
+	unsigned calls[4] = { 0 };
+	hg64 *hg = hg64_create(SIGBITS);
+	hg64t *t = hg64t_create(hg);
+	for(unsigned i = 0; i < 4; i++) {
+		/* well below the median, which is about RANGE / 2 */
+		unsigned w = hg64t_watch(t, quantile[i], RANGE / 4,
+					 crossed, calls);
+		assert(w == i);
+	}
+	uint64_t t0 = nanotime();
+	for(size_t i = 0; i < SAMPLES; i++) {
+		hg64t_add(t, data[i % THREADS][i], 1);
+	}
+	uint64_t t1 = nanotime();
+	double ns = t1 - t0;
+	printf("tracker load time %.1f ms %.2f ns per item\n",
+	       ns / NS_PER_MS, ns / SAMPLES);
+	for(unsigned i = 0; i < 4; i++) {
+		uint64_t value = hg64t_value(t, i);
+		assert(value == hg64_value_at_quantile(hg, quantile[i]));
+		assert(hg64t_above(t, i) == (value > RANGE / 4));
+		/* sorted data crosses the threshold once */
+		assert(calls[i] == 1);
+	}
+	hg64t_destroy(t);
+	hg64_destroy(hg);
+}
+
 static void
 dump_csv(hg64 *hg) {
 	uint64_t value, count;
@@ -255,5 +1576,32 @@ int main(void) {
 	data_vs_hg64(hs, 0.99999);
 	data_vs_hg64(hs, 0.999999);
 
+	totals(hg, hs);
+	thresholds(hg, hs);
+	batch_ranks(hs);
+	tail_stats(hg, hs);
+	distance(hg, hs);
+	columns(hg, hs);
+	downsample(hs);
+	weighted();
+	pool();
+	compact();
+	compact_concurrent();
+	clear_concurrent();
+	clone();
+	clone_reclaim();
+	merge_snapshots(hg, hs);
+	snapshot_speed(hg);
+	memo(hg);
+	publisher(hg);
+	codec(hg);
+	series();
+	mapped(hs);
+	lossy(hs);
+	otlp(hg);
+	http(hg);
+	kernels(hg);
+	tracker();
+
 	//dump_csv(stdout, hg);
 }